@@ -0,0 +1,655 @@
+
+#include "Bands.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Physics.h"
+
+Bands::Bands(SandGrid &g, int count) : grid(g), processes(count), width(g.width()), height(g.height()),
+    chunks(g.now.chunk_count()), chunks_across((width + chunk_size - 1) >> chunk_shift), synced(true), index(-1),
+    rows(0, 0, -1, -1), window(0, 0, -1, -1), classified(false), checked(false) {
+  //Everything shared lives in one mapping: the control block, stats and a
+  //semaphore per band, the chunk flags, the edges, then flat copies of now
+  //and next and the mask
+  size_t cells = width*(size_t)height, edge_cells = 2*3*processes*(size_t)width;
+  mapped = sizeof(Shared) + processes*(sizeof(BandStats) + sizeof(sem_t)) + (2*processes + 3)*(size_t)chunks
+    + edge_cells + 3*cells;
+  static int made = 0;
+  char name[64];
+  sprintf(name, "/sand-bands-%d-%d", (int)getpid(), made++);
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    sys_error("shm_open");
+  }
+  if (ftruncate(fd, mapped) < 0) {
+    sys_error("ftruncate");
+  }
+  void *memory = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (memory == MAP_FAILED) {
+    sys_error("mmap");
+  }
+  close(fd);
+  shm_unlink(name); //The children inherit the mapping, nobody else needs the name
+
+  //Fresh shared memory is all zeroes, so the flags start out clear
+  shared = (Shared *)memory;
+  stats = (BandStats *)(shared + 1);
+  go = (sem_t *)(stats + processes);
+  gathered = (Uint8 *)(go + processes);
+  wants = gathered + processes*(size_t)chunks;
+  flags[0] = wants + processes*(size_t)chunks;
+  flags[1] = flags[0] + chunks;
+  wanted = flags[1] + chunks;
+  edges = wanted + chunks;
+  now_plane = edges + edge_cells;
+  next_plane = now_plane + cells;
+  mask = next_plane + cells;
+
+  if (sem_init(&shared->done, 1, 0)) {
+    sys_error("sem_init");
+  }
+  for (int i = 0; i < processes; i++) {
+    if (sem_init(&go[i], 1, 0)) {
+      sys_error("sem_init");
+    }
+  }
+  shared->round = 0;
+
+  pid_t parent = getpid();
+  for (int i = 0; i < processes; i++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      sys_error("fork");
+    }
+    if (pid == 0) {
+      index = i;
+      worker(parent); //doesn't come back
+    }
+    children.push_back(pid);
+  }
+}
+
+Bands::~Bands() {
+  //No waiting for QUIT to be done: a band that's already gone never will
+  shared->command = QUIT;
+  for (int i = 0; i < processes; i++) {
+    sem_post(&go[i]);
+  }
+  for (size_t i = 0; i < children.size(); i++) {
+    waitpid(children[i], NULL, 0);
+  }
+  for (int i = 0; i < processes; i++) {
+    sem_destroy(&go[i]);
+  }
+  sem_destroy(&shared->done);
+  munmap(shared, mapped);
+}
+
+int Bands::size() {
+  return processes;
+}
+
+void Bands::command(Command c) {
+  //The bands all do 'c', and we wait for them. A band that died would
+  //leave us waiting forever, so every so often we look.
+  shared->command = c;
+  for (int i = 0; i < processes; i++) {
+    sem_post(&go[i]);
+  }
+  for (int done = 0; done < processes; ) {
+    timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += 1;
+    if (sem_timedwait(&shared->done, &until) == 0) {
+      done++;
+    }
+    else if (errno == ETIMEDOUT) {
+      check_children();
+    }
+    else if (errno != EINTR) {
+      sys_error("sem_timedwait");
+    }
+  }
+}
+
+void Bands::check_children() {
+  //Gives up on the run if a band process has gone
+  for (int i = 0; i < processes; i++) {
+    int status;
+    if (waitpid(children[i], &status, WNOHANG) != children[i]) continue;
+    std::cerr << "Band " << i << " (process " << children[i] << ") ";
+    if (WIFSIGNALED(status)) {
+      std::cerr << "was killed by signal " << WTERMSIG(status) << std::endl;
+    }
+    else {
+      std::cerr << "exited with status " << WEXITSTATUS(status) << std::endl;
+    }
+    exit(-1);
+  }
+}
+
+Region Bands::band(int i) {
+  //Whole rows, split as evenly as they go
+  return Region(0, height*i/processes, width-1, height*(i+1)/processes - 1);
+}
+
+Uint8 *Bands::edge(unsigned round, int band, int row) {
+  //Row 0 is a band's top row, 1 and 2 its bottom two
+  return edges + (((round & 1)*processes + band)*3 + row)*(size_t)width;
+}
+
+void Bands::publish_edges(unsigned round) {
+  grid.now.read_row(rows.y0, edge(round, index, 0));
+  grid.now.read_row(rows.y1 - 1, edge(round, index, 1));
+  grid.now.read_row(rows.y1, edge(round, index, 2));
+}
+
+void Bands::worker(pid_t parent) {
+  //A forked copy of the coordinator. If the coordinator goes, so do we,
+  //rather than wait for a command forever.
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+  if (getppid() != parent) {
+    _exit(1);
+  }
+  //Keep just our rows and the halo; the rest stays air and takes no room
+  rows = band(index);
+  window = Region(0, rows.y0 - 2, width-1, rows.y1 + 1).clip(Region(0, 0, width-1, height-1));
+  CellGrid cells(width, height);
+  cells.copy_region(grid.now, window);
+  cells.ticks = grid.now.ticks;
+  grid.a = cells;
+  grid.b = cells;
+  grid.full_copy = true;
+  ungathered.resize(chunks);
+  marks.assign((rows.y1 - rows.y0 + 9)*(size_t)(width + 4), 0);
+  publish_edges(shared->round);
+
+  while (true) {
+    while (sem_wait(&go[index]) != 0) {} //only EINTR
+    switch (shared->command) {
+      case TICK: start_tick(); break;
+      case SHARE: share_band(); break;
+      case GATHER: gather_band(); break;
+      case SCATTER: scatter_band(); break;
+      case FINISH: finish_tick(); break;
+      default: _exit(0);
+    }
+    sem_post(&shared->done);
+  }
+}
+
+void Bands::start_tick() {
+  //The halo from the bands either side, then the simple pass for our rows
+  SandGrid &g = grid;
+  BandStats &s = stats[index];
+  s = BandStats();
+  classified = checked = false;
+  memset(wants + index*(size_t)chunks, 0, chunks);
+  if (index > 0) {
+    g.now.write_row(rows.y0 - 2, edge(shared->round, index-1, 1));
+    g.now.write_row(rows.y0 - 1, edge(shared->round, index-1, 2));
+  }
+  if (index < processes-1) {
+    g.now.write_row(rows.y1 + 1, edge(shared->round, index+1, 0));
+  }
+  g.now.ticks = shared->ticks;
+  g.parity = shared->parity;
+  g.random = shared->random;
+  if (g.engine != shared->engine) {
+    g.set_engine((Engine)shared->engine);
+  }
+  g.full_copy |= shared->full_copy != 0;
+
+  //Our active region is every cell that can write into our rows, which
+  //takes in the row above them
+  Region active(shared->x0, shared->y0, shared->x1, shared->y1);
+  Region writers(active.x0, std::max(active.y0, rows.y0 - 1), active.x1, std::min(active.y1, rows.y1));
+  if (!(writers == g.active)) {
+    g.active = writers;
+    g.full_copy = true;
+  }
+  if (g.changes.size() != chunks) {
+    g.changes.resize(chunks);
+  }
+  g.changes.clear();
+  g.changes.add(g.now.written_chunks());
+  g.now.forget_written();
+  if (!writers.empty() || g.full_copy) {
+    g.copy_active(g.next, g.now);
+  }
+  g.next.forget_written();
+  if (!shared->do_physics || writers.empty()) return;
+
+  if (g.engine == TILE_ENGINE) {
+    g.cached_physics_pass();
+  }
+  else {
+    g.simple_physics_pass();
+  }
+
+  classify(active);
+
+  //Our cloners and destroyers that the coordinator isn't doing
+  if (s.replicators) {
+    Region mine = rows.clip(active);
+    g.clones = g.destroys = 0;
+    for (int x = mine.x0; x <= mine.x1; x++) {
+      for (int y = mine.y0; y <= mine.y1; y++) {
+        if ((mark(x, y) & (REPLICATOR | SHARED_REPLICATOR)) == REPLICATOR) {
+          g.replicator_physics_cell(x, y);
+        }
+      }
+    }
+    s.clones = g.clones;
+    s.destroys = g.destroys;
+  }
+}
+
+void Bands::want(int x, int y) {
+  //The coordinator needs the chunks around (x, y): finding a body of water
+  //looks up to two cells away
+  Uint8 *out = wants + index*(size_t)chunks;
+  int cx0 = std::max(x - 2, 0) >> chunk_shift, cx1 = std::min(x + 2, width - 1) >> chunk_shift;
+  int cy0 = std::max(y - 2, 0) >> chunk_shift, cy1 = std::min(y + 2, height - 1) >> chunk_shift;
+  for (int cy = cy0; cy <= cy1; cy++) {
+    for (int cx = cx0; cx <= cx1; cx++) {
+      out[cy*chunks_across + cx] = 1;
+    }
+  }
+}
+
+bool Bands::spread(Uint8 node, bool square) {
+  //Marks every 'node' within two rows of another band shared, and every one
+  //near enough a shared one to get in its way: two cells across a square
+  //for replicators, or two steps for water. True if there were any.
+  Uint8 shared_node = node << 2;
+  int stride = width + 4, steps[24], step_count = 0;
+  for (int dy = -2; dy <= 2; dy++) {
+    for (int dx = -2; dx <= 2; dx++) {
+      if ((dx || dy) && (square || abs(dx) + abs(dy) <= 2)) {
+        steps[step_count++] = dy*stride + dx;
+      }
+    }
+  }
+  bool any = false;
+  reach.clear();
+  for (int side = 0; side < 2; side++) {
+    if (side == 0 ? index == 0 : index == processes-1) continue;
+    int y0 = side == 0 ? rows.y0 - 2 : rows.y1 - 1;
+    for (int y = std::max(y0, 0); y <= std::min(y0 + 3, height - 1); y++) {
+      for (int x = 0; x < width; x++) {
+        if (mark(x, y) & node) {
+          mark(x, y) |= shared_node;
+          reach.push_back(&mark(x, y) - &marks[0]);
+        }
+      }
+    }
+  }
+  while (!reach.empty()) {
+    //The padding around the marks is never set, so the steps can't leave
+    any = true;
+    int at = reach.back();
+    reach.pop_back();
+    want(at % stride - 2, at/stride + rows.y0 - 4);
+    for (int i = 0; i < step_count; i++) {
+      Uint8 &m = marks[at + steps[i]];
+      if ((m & node) && !(m & shared_node)) {
+        m |= shared_node;
+        reach.push_back(at + steps[i]);
+      }
+    }
+  }
+  return any;
+}
+
+void Bands::classify(Region active) {
+  //Which of our cloners, destroyers and water the coordinator has to do.
+  //A destroyer reaches a cell either way and a cloner a cell down, and a
+  //cloner can make another that clones further down the same tick, so the
+  //two cells under a cloner count as well, and the cloners in the halo
+  //above. Finding a body of water can jump a cell of air, so water two
+  //steps apart might be the same body.
+  BandStats &s = stats[index];
+  std::fill(marks.begin(), marks.end(), 0);
+  classified = true;
+  Region look(active.x0, std::max(active.y0, rows.y0 - 2), active.x1, std::min(active.y1, rows.y1));
+  line.resize(width);
+  for (int y = look.y0; y <= look.y1; y++) {
+    bool ours = y >= rows.y0;
+    grid.now.read_region(Region(look.x0, y, look.x1, y), &line[0]);
+    for (int x = look.x0; x <= look.x1; x++) {
+      switch (line[x - look.x0]) {
+        case CLONER:
+          for (int d = 1; d <= 2 && active.contains(x, y+d); d++) {
+            mark(x, y+d) |= REPLICATOR;
+          }
+          //fall through
+        case DESTROYER:
+          mark(x, y) |= REPLICATOR;
+          s.replicators |= ours;
+          break;
+        case EXPOSED_WATER:
+          if (ours) {
+            mark(x, y) |= WATER | EXPOSED;
+            s.water = 1;
+          }
+          break;
+        case INACTIVE_WATER:
+          if (ours) {
+            mark(x, y) |= WATER;
+          }
+          break;
+        default: break;
+      }
+    }
+  }
+  s.edge_replicators = spread(REPLICATOR, true);
+  s.edge_water = spread(WATER, false);
+}
+
+void Bands::check_changes(Region active) {
+  //Whether our rows changed this tick, once next is finished
+  BandStats &s = stats[index];
+  checked = true;
+  Region changeable = rows.clip(active.grow(1));
+  s.changed = !grid.next.same_cells(grid.now, changeable);
+  if (shared->count_changes && s.changed) {
+    s.changed_cells = grid.next.count_different(grid.now, changeable);
+  }
+}
+
+void Bands::finish_tick() {
+  //Water, then on to the next tick the way update() does
+  SandGrid &g = grid;
+  BandStats &s = stats[index];
+  if (shared->do_physics) {
+    if (!g.active.empty()) {
+      Region active(shared->x0, shared->y0, shared->x1, shared->y1);
+      Region mine = rows.clip(active);
+      if (!checked) {
+        check_changes(active);
+      }
+      if (s.water) {
+        //If the coordinator did some, ours were found before its went in
+        s.water_moved = shared->shared_area ? g.fluid_sim.move_bodies() : g.fluid_sim.run(g.now, mine, g.random);
+        s.water_bodies = g.fluid_sim.bodies_found();
+      }
+      g.settled = !shared->shared_area && !s.changed && !s.water_moved;
+    }
+    g.now.ticks = g.next.ticks = shared->ticks + 1;
+  }
+  g.changes.add(g.parity ? g.now.written_chunks() : g.next.written_chunks());
+  if (shared->shared_area) {
+    //The coordinator's 'now' is this tick's now, not whichever we end up
+    //with, so it needs both sides of whatever got written
+    ungathered.add(g.now.written_chunks());
+    ungathered.add(g.next.written_chunks());
+  }
+  g.now.forget_written();
+  g.next.forget_written();
+  g.toggle_parity();
+  g.compact();
+  g.full_copy = false;
+  ungathered.add(g.changes);
+  if (g.tiles != NULL) {
+    s.tiles = g.tiles->get_stats();
+  }
+  publish_edges(shared->round + 1);
+}
+
+void Bands::find_water(Region active) {
+  //The bodies of water the coordinator left us, in the same order the
+  //whole world would find them, while now is still as the tick started
+  if (!stats[index].water) return;
+  Region mine = rows.clip(active);
+  cells.clear();
+  for (int x = mine.x0; x <= mine.x1; x++) {
+    for (int y = mine.y0; y <= mine.y1; y++) {
+      if ((mark(x, y) & (EXPOSED | SHARED_WATER)) == EXPOSED) {
+        cells.push_back(Coord(x, y));
+      }
+    }
+  }
+  grid.fluid_sim.find_bodies(grid.now, mine, grid.random, cells, NULL);
+}
+
+void Bands::share_band() {
+  //Our rows of the chunks the coordinator wants, from both grids, and
+  //which of the cells are its to do
+  for (int i = 0; i < chunks; i++) {
+    if (!wanted[i]) continue;
+    Region part = grid.now.chunk_region(i).clip(rows);
+    for (int y = part.y0; y <= part.y1; y++) {
+      Region row(part.x0, y, part.x1, y);
+      size_t at = y*(size_t)width + part.x0;
+      grid.now.read_region(row, now_plane + at);
+      grid.next.read_region(row, next_plane + at);
+      for (int x = part.x0; x <= part.x1; x++) {
+        mask[y*(size_t)width + x] = classified ? (mark(x, y) & (SHARED_REPLICATOR | SHARED_WATER)) >> 2 : 0;
+      }
+    }
+  }
+}
+
+void Bands::gather_band() {
+  //Our rows of every chunk that changed since last time into now_plane
+  const std::vector<int> &list = ungathered.list();
+  for (size_t i = 0; i < list.size(); i++) {
+    Region part = grid.now.chunk_region(list[i]).clip(rows);
+    if (part.empty()) continue;
+    for (int y = part.y0; y <= part.y1; y++) {
+      grid.now.read_region(Region(part.x0, y, part.x1, y), now_plane + y*(size_t)width + part.x0);
+    }
+    gathered[index*(size_t)chunks + list[i]] = 1;
+  }
+  ungathered.clear();
+}
+
+void Bands::scatter_band() {
+  //Chunks the coordinator changed, into our rows and the halo. In a tick,
+  //next is finished once it's in, and now isn't till after the water.
+  for (int i = 0; i < chunks; i++) {
+    if (flags[1][i]) {
+      grid.next.write_flat(grid.next.chunk_region(i).clip(window), next_plane, width);
+    }
+  }
+  if (shared->in_tick && classified) {
+    Region active(shared->x0, shared->y0, shared->x1, shared->y1);
+    check_changes(active);
+    find_water(active);
+  }
+  for (int i = 0; i < chunks; i++) {
+    if (flags[0][i]) {
+      grid.now.write_flat(grid.now.chunk_region(i).clip(window), now_plane, width);
+    }
+  }
+  publish_edges(shared->round);
+}
+
+void Bands::put(int plane, const CellGrid &cells, const ChunkSet &list) {
+  //Chunks of ours for scatter_band
+  Uint8 *out = plane ? next_plane : now_plane;
+  const std::vector<int> &chunk_list = list.list();
+  for (size_t i = 0; i < chunk_list.size(); i++) {
+    cells.read_chunk(chunk_list[i], out, width);
+    flags[plane][chunk_list[i]] = 1;
+  }
+}
+
+void Bands::collect(CellGrid &now, ChunkSet &changed) {
+  //The other way: every chunk a band has changed since we last asked
+  command(GATHER);
+  for (int band_index = 0; band_index < processes; band_index++) {
+    //Only the band's own rows; whatever's in now_plane around them is old
+    Uint8 *got = gathered + band_index*(size_t)chunks;
+    for (int i = 0; i < chunks; i++) {
+      if (got[i]) {
+        now.write_flat(now.chunk_region(i).clip(band(band_index)), now_plane, width);
+        changed.add(i);
+        got[i] = 0;
+      }
+    }
+  }
+  synced = true;
+}
+
+Bands::Tick Bands::tick(CellGrid &now, CellGrid &next, Region active, bool parity, bool do_physics, bool full_copy, bool count_changes, ChunkSet &changed) {
+  //One update() of the world. 'now' and 'next' only get used if something
+  //reaches across a band, and then they're gathered first.
+  Tick t = {false, 0, 0, 0, 0, 0};
+  shared->x0 = active.x0;
+  shared->y0 = active.y0;
+  shared->x1 = active.x1;
+  shared->y1 = active.y1;
+  shared->ticks = now.ticks;
+  shared->parity = parity;
+  shared->do_physics = do_physics;
+  shared->full_copy = full_copy;
+  shared->engine = grid.engine;
+  shared->count_changes = count_changes;
+  shared->random = grid.random;
+  command(TICK);
+
+  bool replicators = false, water = false;
+  for (int i = 0; i < processes; i++) {
+    replicators |= stats[i].edge_replicators != 0;
+    water |= stats[i].edge_water != 0;
+  }
+  shared->shared_area = replicators || water;
+  if (shared->shared_area) {
+    //Those are ours: take the chunks around them, do them in scan order and
+    //hand back what changed
+    area.clear();
+    for (int i = 0; i < chunks; i++) {
+      Uint8 want = 0;
+      for (int b = 0; b < processes; b++) {
+        want |= wants[b*(size_t)chunks + i];
+      }
+      wanted[i] = want;
+      if (want) {
+        area.push_back(i);
+      }
+    }
+    command(SHARE);
+    for (size_t i = 0; i < area.size(); i++) {
+      Region part = now.chunk_region(area[i]);
+      now.write_flat(part, now_plane, width);
+      next.write_flat(part, next_plane, width);
+      changed.add(area[i]);
+    }
+    now.forget_written();
+    next.forget_written();
+    if (replicators) {
+      shared_cells(SHARED_REPLICATOR >> 2);
+      grid.clones = grid.destroys = 0;
+      for (size_t i = 0; i < cells.size(); i++) {
+        grid.replicator_physics_cell(cells[i].x, cells[i].y);
+      }
+      t.clones = grid.clones;
+      t.destroys = grid.destroys;
+    }
+    if (water) {
+      shared_cells(SHARED_WATER >> 2);
+      grid.fluid_sim.find_bodies(now, active, grid.random, cells, &area);
+      t.water_moved = grid.fluid_sim.move_bodies();
+      t.water_bodies = grid.fluid_sim.bodies_found();
+    }
+    put(0, now, now.written_chunks());
+    put(1, next, next.written_chunks());
+    shared->in_tick = 1;
+    command(SCATTER);
+    shared->in_tick = 0;
+    memset(flags[0], 0, 2*chunks);
+    memset(wanted, 0, chunks);
+    now.forget_written();
+    next.forget_written();
+  }
+  command(FINISH);
+  shared->round++;
+  synced = false;
+
+  for (int i = 0; i < processes; i++) {
+    t.changed |= stats[i].changed != 0;
+    t.changed_cells += stats[i].changed_cells;
+    t.water_moved += stats[i].water_moved;
+    t.water_bodies += stats[i].water_bodies;
+    t.clones += stats[i].clones;
+    t.destroys += stats[i].destroys;
+  }
+  return t;
+}
+
+void Bands::shared_cells(Uint8 bit) {
+  //The cells in 'area' with 'bit' in the mask, a column at a time down the
+  //whole world like every pass
+  cells.clear();
+  int chunks_down = chunks/chunks_across;
+  std::vector<int> order(area.size());
+  for (size_t i = 0; i < area.size(); i++) {
+    order[i] = (area[i] % chunks_across)*chunks_down + area[i]/chunks_across;
+  }
+  std::sort(order.begin(), order.end());
+  for (size_t first = 0; first < order.size(); ) {
+    int cx = order[first]/chunks_down;
+    size_t last = first;
+    while (last < order.size() && order[last]/chunks_down == cx) {
+      last++;
+    }
+    for (int x = cx << chunk_shift; x < std::min((cx + 1) << chunk_shift, width); x++) {
+      for (size_t i = first; i < last; i++) {
+        int y0 = (order[i] % chunks_down) << chunk_shift;
+        for (int y = y0; y < std::min(y0 + chunk_size, height); y++) {
+          if (mask[y*(size_t)width + x] & bit) {
+            cells.push_back(Coord(x, y));
+          }
+        }
+      }
+    }
+    first = last;
+  }
+}
+
+bool Bands::gather(CellGrid &now, ChunkSet &changed) {
+  //Bring our 'now' up to date with the bands; false if it already was
+  if (synced) return false;
+  collect(now, changed);
+  return true;
+}
+
+void Bands::scatter(const CellGrid &now, const ChunkSet &list) {
+  //Chunks changed here (edits), out to the bands
+  if (list.empty()) return;
+  put(0, now, list);
+  command(SCATTER);
+  memset(flags[0], 0, chunks);
+}
+
+void Bands::restored() {
+  //Our 'now' was just replaced outright, so it's the newest there is
+  synced = true;
+}
+
+const TileCache::Stats &Bands::tile_stats() {
+  //Every band's cache, added up
+  tile_totals = TileCache::Stats();
+  for (int i = 0; i < processes; i++) {
+    tile_totals.hits += stats[i].tiles.hits;
+    tile_totals.misses += stats[i].tiles.misses;
+    tile_totals.evictions += stats[i].tiles.evictions;
+    tile_totals.uncached += stats[i].tiles.uncached;
+    tile_totals.empty += stats[i].tiles.empty;
+  }
+  return tile_totals;
+}
@@ -0,0 +1,126 @@
+#ifndef BANDS_H
+#define BANDS_H
+
+#include <vector>
+#include <semaphore.h>
+#include <sys/types.h>
+
+#include "CellGrid.h"
+#include "Random.h"
+#include "TileCache.h"
+
+class SandGrid;
+
+/*
+The world split into horizontal bands, each kept and stepped by its own
+process. A band process is a fork of the coordinator that throws away
+everything but its own rows and the halo around them (two rows above, one
+below), which is all a tick of its rows ever reads. After each tick every
+band leaves its top row and bottom two rows in shared memory for the bands
+either side to pick up, and that's all that goes between them.
+
+Cloners, destroyers and water are done in the bands too, except for the
+ones that could reach across an edge: anything within two rows of one, and
+whatever is near enough those to be in the way (a cloner's chain, the rest
+of a body of water). The coordinator takes just the chunks around those,
+does them in scan order and hands back what it changed; everything else
+stays in its band.
+
+The coordinator's own copy of the world is only brought up to date when
+somebody asks (gather()), and then only the chunks that changed since.
+Edits go the other way with scatter().
+*/
+class Bands {
+public:
+  //What a tick did, for the counters
+  struct Tick {
+    bool changed; //some cell in next differs from now
+    long long changed_cells, water_moved, water_bodies;
+    int clones, destroys;
+  };
+
+private:
+  enum Command { TICK, SHARE, GATHER, SCATTER, FINISH, QUIT };
+  enum Mark { REPLICATOR = 1, WATER = 2, SHARED_REPLICATOR = 4, SHARED_WATER = 8, EXPOSED = 16 };
+  struct BandStats {
+    int replicators, edge_replicators; //in the band, and some for the coordinator
+    int water, edge_water;
+    int changed;
+    long long changed_cells, water_moved, water_bodies;
+    int clones, destroys;
+    TileCache::Stats tiles;
+  };
+  struct Shared {
+    sem_t done; //a post from each band once it's done the command
+    int command;
+    int x0, y0, x1, y1; //the active region this tick
+    int ticks, parity, do_physics, full_copy, engine, count_changes;
+    int shared_area; //the coordinator did some of this tick
+    int in_tick; //this SCATTER is the coordinator handing back its part of a tick
+    unsigned round; //which set of edges is this tick's
+    Random random;
+  };
+
+  SandGrid &grid;
+  int processes;
+  int width, height, chunks, chunks_across;
+  size_t mapped;
+  Shared *shared;
+  BandStats *stats;
+  sem_t *go; //a post per band to do the command
+  Uint8 *gathered; //a byte per band per chunk: its rows of the chunk are in now_plane
+  Uint8 *flags[2]; //a byte per chunk that's been put whole in now_plane or next_plane
+  Uint8 *wants; //a byte per band per chunk the coordinator needs this tick
+  Uint8 *wanted; //all the bands' wants
+  Uint8 *edges; //2 sets, of 3 rows per band
+  Uint8 *now_plane, *next_plane;
+  Uint8 *mask; //the cells the coordinator does: SHARED_REPLICATOR or SHARED_WATER, shifted down
+  std::vector<int> area; //the chunks wanted this tick
+  std::vector<Coord> cells;
+  std::vector<pid_t> children;
+  bool synced; //the coordinator's 'now' is as new as the bands'
+  TileCache::Stats tile_totals;
+
+  //In a band process
+  int index;
+  Region rows, window; //ours, and ours with the halo
+  ChunkSet ungathered; //chunks that changed since the coordinator last asked
+  std::vector<Uint8> marks; //Mark bits for our rows and two either side, in two cells of padding
+  std::vector<int> reach;
+  std::vector<Uint8> line;
+  bool classified, checked;
+
+  Bands(const Bands &);
+  void command(Command c);
+  void check_children();
+  Region band(int i);
+  Uint8 *edge(unsigned round, int band, int row);
+  void publish_edges(unsigned round);
+  void worker(pid_t parent);
+  inline Uint8 &mark(int x, int y) { return marks[(y - rows.y0 + 4)*(size_t)(width + 4) + x + 2]; }
+  void want(int x, int y);
+  bool spread(Uint8 node, bool square);
+  void classify(Region active);
+  void check_changes(Region active);
+  void find_water(Region active);
+  void start_tick();
+  void finish_tick();
+  void share_band();
+  void gather_band();
+  void scatter_band();
+  void put(int plane, const CellGrid &cells, const ChunkSet &list);
+  void collect(CellGrid &now, ChunkSet &changed);
+  void shared_cells(Uint8 bit);
+
+public:
+  Bands(SandGrid &grid, int processes);
+  ~Bands();
+  int size();
+  Tick tick(CellGrid &now, CellGrid &next, Region active, bool parity, bool do_physics, bool full_copy, bool count_changes, ChunkSet &changed);
+  bool gather(CellGrid &now, ChunkSet &changed);
+  void scatter(const CellGrid &now, const ChunkSet &chunks);
+  void restored();
+  const TileCache::Stats &tile_stats();
+};
+
+#endif /* BANDS_H */
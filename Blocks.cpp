@@ -0,0 +1,36 @@
+
+#include "Blocks.h"
+
+const BlockRules block_rules;
+
+static inline bool is_water(Uint8 c) {
+  return c == EXPOSED_WATER || c == INACTIVE_WATER;
+}
+
+BlockRules::BlockRules() {
+  for (int i = 0; i < block_cases; i++) {
+    //0 1
+    //2 3
+    Uint8 c[4];
+    for (int k = 0, rest = i; k < 4; k++, rest /= CELL_TYPE_COUNT) {
+      c[k] = rest % CELL_TYPE_COUNT;
+    }
+    for (int top = 0; top < 2; top++) {
+      //Straight down
+      int below = top + 2;
+      if ((c[top] == SAND || is_water(c[top])) && c[below] == AIR) {
+        c[below] = c[top] == SAND ? SAND : EXPOSED_WATER;
+        c[top] = AIR;
+      }
+    }
+    for (int top = 0; top < 2; top++) {
+      //Water that's still up there spills over into the other column
+      int side = 1 - top, below = top + 2, diagonal = side + 2;
+      if (is_water(c[top]) && c[below] != AIR && c[side] == AIR && c[diagonal] == AIR) {
+        c[diagonal] = EXPOSED_WATER;
+        c[top] = AIR;
+      }
+    }
+    table[i] = c[0] | (c[1] << 8) | (c[2] << 16) | ((Uint32)c[3] << 24);
+  }
+}
@@ -0,0 +1,40 @@
+
+#ifndef BLOCKS_H
+#define BLOCKS_H
+
+#include "CellData.h"
+
+const int block_cases = CELL_TYPE_COUNT*CELL_TYPE_COUNT*CELL_TYPE_COUNT*CELL_TYPE_COUNT;
+
+/*
+What a 2x2 block of cells turns into under BLOCK_RULES, worked out up front
+for every block there can be. Each block only depends on itself, so a
+whole block step can go in any order, or all at once.
+
+Inside a block sand and water fall into air under them, and water that
+can't fall spills down diagonally into air, as in simple_physics_cell.
+Water that moves comes out exposed; whoever uses the table sorts out
+which water is exposed afterwards, since that depends on cells outside
+the block.
+*/
+class BlockRules {
+private:
+  Uint32 table[block_cases]; //the new block, a byte per cell in the same order
+
+public:
+  BlockRules();
+
+  //The cells are top left, top right, bottom left, bottom right, and all
+  //below CELL_TYPE_COUNT
+  inline void apply(Uint8 &tl, Uint8 &tr, Uint8 &bl, Uint8 &br) const {
+    Uint32 result = table[((br*CELL_TYPE_COUNT + bl)*CELL_TYPE_COUNT + tr)*CELL_TYPE_COUNT + tl];
+    tl = result;
+    tr = result >> 8;
+    bl = result >> 16;
+    br = result >> 24;
+  }
+};
+
+extern const BlockRules block_rules;
+
+#endif /* BLOCKS_H */
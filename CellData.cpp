@@ -29,6 +29,10 @@ Uint32 CellData::color(CellType c) {
   return cell_data[c].data_uint_color;
 }
 
+SDL_Color CellData::rgb(CellType c) {
+  return cell_data[c].data_sdl_color;
+}
+
 const wchar_t *CellData::name(CellType c) {
   return cell_data[c].data_name;
 }
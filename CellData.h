@@ -30,6 +30,7 @@ struct CellData {
 // public:
   static void init_color(SDL_Surface *screen);
   static Uint32 color(CellType c);
+  static SDL_Color rgb(CellType c);
   static const wchar_t *name(CellType c);
   static CellType lookup(wchar_t initial_letter);
 };
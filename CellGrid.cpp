@@ -1,264 +1,481 @@
 #include "CellGrid.h"
 
-#include <SDL/SDL.h>
-#include <SDL/SDL_gfxPrimitives.h>
+#include <string.h>
+#include <algorithm>
 
 #include "common.h"
 
 
-CellGrid::CellGrid() {
-  for (int x = 0; x < grid_size; x++) {
-    for (int y = 0; y < grid_size; y++) {
-      grid[x][y] = AIR;
-    }
-  }
-  water_surface = SDL_CreateRGBSurface(SDL_SWSURFACE,
-        block_pixel_size, block_pixel_size, /*dimensions*/
-        32, 0, 0, 0, 0 /*bits per pixel, RGBA masks*/);
-  if (water_surface == NULL) {
-    sdl_error();
+CellGrid::CellGrid(int w, int h) : width(w), height(h),
+    chunks_across((w + chunk_size-1) >> chunk_shift), chunks_down((h + chunk_size-1) >> chunk_shift),
+    chunks(chunks_across*chunks_down, Chunk(AIR)), written(chunks_across*chunks_down), dense_count(0), ticks(0) {}
+
+CellGrid &CellGrid::operator=(const CellGrid &other) {
+  //What's been written stays with this grid, and now that's everything
+  if (this == &other) return *this;
+  width = other.width;
+  height = other.height;
+  chunks_across = other.chunks_across;
+  chunks_down = other.chunks_down;
+  chunks = other.chunks;
+  dense_count = other.dense_count;
+  speeds = other.speeds;
+  ticks = other.ticks;
+  if (written.size() != (int)chunks.size()) {
+    written.resize(chunks.size());
   }
-  SDL_FillRect(water_surface, NULL, CellData::color(EXPOSED_WATER));
-  ticks = 0;
+  written.add_all();
+  return *this;
 }
 
+void CellGrid::swap(CellGrid &other) {
+  //Just the pointers
+  std::swap(width, other.width);
+  std::swap(height, other.height);
+  std::swap(chunks_across, other.chunks_across);
+  std::swap(chunks_down, other.chunks_down);
+  chunks.swap(other.chunks);
+  std::swap(dense_count, other.dense_count);
+  speeds.swap(other.speeds);
+  std::swap(written, other.written);
+  std::swap(ticks, other.ticks);
+}
 
-CellGrid::~CellGrid() {
-  //SDL_FreeSurface(water_surface); //Already gets freed?
+void CellGrid::use_speeds(bool on) {
+  //Everything starts out still
+  std::vector<std::vector<Uint8> >().swap(speeds);
+  if (on) speeds.resize(chunks.size());
 }
 
-CellType CellGrid::get(int x, int y, CellType default_type) {
-  if (in_bounds(x, y)) {
-    return grid[x][y];
+void CellGrid::copy_speeds(const CellGrid &src, Region r) {
+  r = r.clip(Region(0, 0, width-1, height-1));
+  if (r.empty() || speeds.empty() || src.speeds.empty()) return;
+  for (int cy = r.y0 >> chunk_shift; cy <= r.y1 >> chunk_shift; cy++) {
+    for (int cx = r.x0 >> chunk_shift; cx <= r.x1 >> chunk_shift; cx++) {
+      int n = cy*chunks_across + cx;
+      std::vector<Uint8> &to = speeds[n];
+      const std::vector<Uint8> &from = src.speeds[n];
+      Region whole = chunk_region(cx, cy), part = whole.clip(r);
+      if (part == whole || (to.empty() && from.empty())) {
+        to = from;
+        continue;
+      }
+      if (to.empty()) to.assign(chunk_cells, 0);
+      for (int y = part.y0; y <= part.y1; y++) {
+        int i = chunk_index(part.x0, y), count = part.x1 - part.x0 + 1;
+        if (from.empty()) memset(&to[i], 0, count);
+        else memcpy(&to[i], &from[i], count);
+      }
+    }
   }
-  return default_type;
 }
 
-inline int rotate_cc(int i) {
-  return (i+1) % 8;
+void CellGrid::read_speed_row(int y, Uint8 *out) const {
+  for (int x0 = 0; x0 < width; x0 += chunk_size) {
+    int n = std::min(chunk_size, width - x0);
+    const std::vector<Uint8> *block = speeds.empty() ? NULL : &speeds[chunk_number(x0, y)];
+    if (block == NULL || block->empty()) memset(out + x0, 0, n);
+    else memcpy(out + x0, &(*block)[chunk_index(x0, y)], n);
+  }
 }
 
-inline int rotate_co(int i) {
-  if (i == 0) return 7;
-  return i-1;
+void CellGrid::write_speed_row(int y, const Uint8 *in) {
+  //Chunks with nothing falling in this row don't get a block for it
+  if (speeds.empty()) return;
+  for (int x0 = 0; x0 < width; x0 += chunk_size) {
+    int n = std::min(chunk_size, width - x0);
+    std::vector<Uint8> &block = speeds[chunk_number(x0, y)];
+    if (block.empty()) {
+      int x = 0;
+      while (x < n && in[x0 + x] == 0) x++;
+      if (x == n) continue;
+      block.assign(chunk_cells, 0);
+    }
+    memcpy(&block[chunk_index(x0, y)], in + x0, n);
+  }
 }
 
-inline int opposite(int i) {
-  return (i+4) % 8;
+void CellGrid::still(int n, int i, const Uint8 *in, int count) {
+  //in[0..count) is going into chunk n from index i on
+  if (speeds.empty() || speeds[n].empty()) return;
+  const Chunk &chunk = chunks[n];
+  for (int k = 0; k < count; k++) {
+    if (chunk.get(i + k) != in[k]) speeds[n][i + k] = 0;
+  }
 }
 
-inline float horizontal(int i) {
-  if (i == 7 || i == 6 || i == 5) return 0.0;
-  if (i == 0 || i == 4) return 0.5;
-  if (i == 1 || i == 2 || i == 3) return 1.0;
-  throw i;
+void CellGrid::still(int n, int i, CellType c, int count) {
+  //The same, for count of c
+  if (speeds.empty() || speeds[n].empty()) return;
+  const Chunk &chunk = chunks[n];
+  for (int k = 0; k < count; k++) {
+    if (chunk.get(i + k) != c) speeds[n][i + k] = 0;
+  }
 }
 
-inline float vertical(int i) {
-  if (i == 7 || i == 0 || i == 1) return 0.0;
-  if (i == 6 || i == 2) return 0.5;
-  if (i == 5 || i == 4 || i == 3) return 1.0;
-  throw i;
+Region CellGrid::chunk_region(int cx, int cy) const {
+  //The cells of a chunk that are inside the world
+  int x0 = cx << chunk_shift, y0 = cy << chunk_shift;
+  return Region(x0, y0, std::min(x0 + chunk_size-1, width-1), std::min(y0 + chunk_size-1, height-1));
 }
 
-
-
-int angle(int r, int t) {
-  return r - t;
+Region CellGrid::chunk_region(int i) const {
+  return chunk_region(i % chunks_across, i / chunks_across);
 }
 
-int normalize_angle(int r) {
-  if (r < 0) return r+8;
-  else if (r >= 8) return r - 8;
-  return r;
+void CellGrid::fill_span(int x0, int x1, int y, CellType c) {
+  //x0 to x1 inclusive, clipped to the grid
+  if (y < 0 || y >= height) return;
+  if (x0 < 0) x0 = 0;
+  if (x1 >= width) x1 = width - 1;
+  while (x0 <= x1) {
+    int end = std::min(x1, x0 | (chunk_size-1));
+    Chunk &chunk = chunk_at(x0, y);
+    if (!chunk.is_uniform(c)) {
+      still(chunk_number(x0, y), chunk_index(x0, y), c, end - x0 + 1);
+      memset(expand(chunk) + chunk_index(x0, y), c, end - x0 + 1);
+      written.add(chunk_number(x0, y));
+    }
+    x0 = end + 1;
+  }
 }
 
-/*
-7  0  1
-6 -1  2
-5  4  3
-*/
-
-void CellGrid::draw_active_water(Coord here) {
-  //Draw the water located at 'here' to water_surface
-  //...fancy!
-  CellBox cell = CellBox(*this, here, AIR, ROCK, INACTIVE_WATER, INACTIVE_WATER);
-  int exposed_count = cell.count(EXPOSED_WATER);
-  int inactive_count = cell.count(INACTIVE_WATER);
-  int air_count = cell.count(AIR);
-
-  //We draw either a bubble, or a wave.
-  bool draw_bubble = true;
-  //These are directions, for drawing waves.
-  //a1 and a2 indicate what the lines will be drawn through.
-  int a1 = -1, a2 = -1;
-  //'under' indicates what part is under water
-  int under = -1;
- 
+void CellGrid::read_row(int y, Uint8 *out) const {
+  for (int x0 = 0; x0 < width; x0 += chunk_size) {
+    const Chunk &chunk = chunk_at(x0, y);
+    const Uint8 *cells = chunk.dense_cells();
+    int n = std::min(chunk_size, width - x0);
+    if (cells != NULL) {
+      memcpy(out + x0, cells + chunk_index(x0, y), n);
+    }
+    else {
+      for (int x = 0; x < n; x++) {
+        out[x0 + x] = chunk.get(chunk_index(x0 + x, y));
+      }
+    }
+  }
+}
 
-  //Determine how to proceed
-  if (air_count == 3 && exposed_count == 0 && inactive_count == 1) {
-    //tower of water?
-    int d = cell.find(INACTIVE_WATER);
-    a1 = rotate_cc(d);
-    a2 = rotate_co(d);
-    under = d;
-    draw_bubble = false;
+void CellGrid::write_row(int y, const Uint8 *in) {
+  //Chunks that already match are left alone, so they stay packed
+  for (int x0 = 0; x0 < width; x0 += chunk_size) {
+    Chunk &chunk = chunk_at(x0, y);
+    int n = std::min(chunk_size, width - x0);
+    if (!chunk.is_dense()) {
+      int x = 0;
+      while (x < n && chunk.get(chunk_index(x0 + x, y)) == in[x0 + x]) x++;
+      if (x == n) continue;
+    }
+    else if (!memcmp(chunk.dense_cells() + chunk_index(x0, y), in + x0, n)) {
+      continue;
+    }
+    still(chunk_number(x0, y), chunk_index(x0, y), in + x0, n);
+    memcpy(expand(chunk) + chunk_index(x0, y), in + x0, n);
+    written.add(chunk_number(x0, y));
   }
-  else if (air_count == 2 && exposed_count == 1 && inactive_count == 1) {
-    int e = cell.find(EXPOSED_WATER), i = cell.find(INACTIVE_WATER);
-    int ei_angle = normalize_angle(angle(e, i));
-    if (ei_angle == 4) {
-      //opposite
-      a1 = rotate_cc(i);
-      a2 = rotate_co(i);
-      under = i;
+}
+
+void CellGrid::read_region(Region r, Uint8 *out, CellType default_type) const {
+  int w = r.x1 - r.x0 + 1;
+  for (int y = r.y0; y <= r.y1; y++, out += w) {
+    if (y < 0 || y >= height) {
+      memset(out, default_type, w);
+      continue;
     }
-    else if (ei_angle == 2 || ei_angle == 6) {
-      //adjacent
-      a1 = e;
-      under = i;
-      //a2 is i rotated away from a1
-      if (ei_angle == 6) {
-        a2 = rotate_cc(i);
+    for (int x = r.x0; x <= r.x1; ) {
+      if (x < 0 || x >= width) {
+        out[x++ - r.x0] = default_type;
+        continue;
+      }
+      const Chunk &chunk = chunk_at(x, y);
+      const Uint8 *cells = chunk.dense_cells();
+      int n = std::min(r.x1 + 1, std::min(width, (x | (chunk_size-1)) + 1)) - x;
+      if (cells != NULL) {
+        memcpy(out + x - r.x0, cells + chunk_index(x, y), n);
       }
       else {
-        a2 = rotate_co(i);
+        for (int i = 0; i < n; i++) {
+          out[x + i - r.x0] = chunk.get(chunk_index(x + i, y));
+        }
       }
+      x += n;
     }
-    else {
-      throw ei_angle;
-    }
-    draw_bubble = false;
   }
-  else if (air_count == 1 && exposed_count == 2 && inactive_count == 1) {
-    int e1 = cell.find(EXPOSED_WATER, 0), e2 = cell.find(EXPOSED_WATER, 1);
-    if (normalize_angle(angle(e1, e2)) == 4) {
-      //We've got two exposeds opposite, with an inactive on one side
-      //put the line between the two inactives
-      a1 = e1;
-      a2 = e2;
-      draw_bubble = false;
-      under = cell.find(INACTIVE_WATER);
-    }
+}
+
+void CellGrid::read_chunk(int i, Uint8 *out, int stride) const {
+  Region r = chunk_region(i);
+  for (int y = r.y0; y <= r.y1; y++) {
+    read_region(Region(r.x0, y, r.x1, y), out + y*stride + r.x0);
   }
-  else if (air_count == 1 && exposed_count == 1 && inactive_count == 2) {
-    //similiar to above, except we want two inactives adjacent
-    int i1 = cell.find(INACTIVE_WATER, 0), i2 = cell.find(INACTIVE_WATER, 1);
-    int n = normalize_angle(angle(i1, i2));
-    if (n == 2 || n == 6) {
-      draw_bubble = false;
-      int e = cell.find(EXPOSED_WATER);
-      int between = opposite(cell.find_air());
-      a1 = e;
-      a2 = opposite(e);
-      under = between;
-      int direction = normalize_angle(angle(between, a2));
-      if (direction == 6) {
-        a2 = rotate_cc(a2);
+}
+
+void CellGrid::write_flat(Region r, const Uint8 *in, int stride) {
+  //Chunks that already match are left alone, like write_row
+  r = r.clip(Region(0, 0, width-1, height-1));
+  for (int y = r.y0; y <= r.y1; y++) {
+    for (int x = r.x0; x <= r.x1; ) {
+      Chunk &chunk = chunk_at(x, y);
+      const Uint8 *cells = in + y*(size_t)stride + x;
+      int n = std::min(r.x1 + 1, (x | (chunk_size-1)) + 1) - x;
+      int same = 0;
+      if (chunk.is_dense()) {
+        same = memcmp(chunk.dense_cells() + chunk_index(x, y), cells, n) ? 0 : n;
       }
       else {
-        a2 = rotate_co(a2);
+        while (same < n && chunk.get(chunk_index(x + same, y)) == cells[same]) same++;
+      }
+      if (same < n) {
+        still(chunk_number(x, y), chunk_index(x, y), cells, n);
+        memcpy(expand(chunk) + chunk_index(x, y), cells, n);
+        written.add(chunk_number(x, y));
       }
+      x += n;
     }
   }
-  
-
-  
-  //Now do the drawing
-  int seed = (here.x << here.y) + (ticks/15); //used for RNG
-  const Uint32 surface_color = CellData::color(EXPOSED_WATER);
-  const Uint32 under_water = CellData::color(INACTIVE_WATER);
-  SDL_FillRect(water_surface, NULL, CellData::color(AIR));
-
-  if (draw_bubble) {
-    if (air_count == 4) {
-      //draw drop of water instead
-      seed = (here.x * 191) >> 3;
-      const int offset = (block_pixel_size/2) - 1;
-      const int radius = (block_pixel_size/3)-(seed % 5);
-      filledCircleColor(water_surface, offset, offset, radius, under_water);
-      circleColor(water_surface, offset, offset, radius, surface_color);
-    }
-    else {
-      //A few random foamy bubbles
-      if (inactive_count == 4) {
-        //Put them in water
-        SDL_FillRect(water_surface, NULL, CellData::color(INACTIVE_WATER));
+}
+
+bool CellGrid::same_cells(const CellGrid &other) const {
+  //ticks and the water surface don't count, only what's in the cells
+  return width == other.width && height == other.height
+    && same_cells(other, Region(0, 0, width-1, height-1));
+}
+
+int CellGrid::compact(Region keep, const CellGrid *unless_changed) {
+  //Pack every chunk that's entirely outside 'keep', and those inside it
+  //that are the same as in 'unless_changed'. Returns how many got packed.
+  int packed = 0;
+  for (int cy = 0; cy < chunks_down; cy++) {
+    for (int cx = 0; cx < chunks_across; cx++) {
+      Chunk &chunk = chunks[cy*chunks_across + cx];
+      if (!chunk.is_dense()) continue;
+      Region whole = chunk_region(cx, cy);
+      if (!whole.clip(keep).empty()
+          && (unless_changed == NULL || !same_cells(*unless_changed, whole))) {
+        continue;
       }
-      //TODO: Maybe have some larger, darker circles in the background?
-      for (int bubble_count = 100 + (seed % 4); bubble_count; bubble_count--) {
-        float fx = (seed % 20)/20.0;
-        seed *= bubble_count+130;
-        float fy = (seed % 17)/17.0;
-        seed *= 113;
-        int radius = (block_pixel_size/10) + (seed % 2);
-        int x = block_pixel_size*fx, y = block_pixel_size*fy;
-        if (x - radius < 0 || y - radius < 0
-          || x+radius+2 >= block_pixel_size || x+radius+2 >= block_pixel_size) {
-          continue; //won't fit
-          //XXX Some bubbles that don't fit still get drawn?
+      if (chunk.pack(whole.x1 - whole.x0 + 1, whole.y1 - whole.y0 + 1)) {
+        packed++;
+        dense_count--;
+        //Nothing much happens in a packed chunk; if nothing's falling in
+        //it either its speeds can go
+        std::vector<Uint8> *block = speeds.empty() ? NULL : &speeds[cy*chunks_across + cx];
+        if (block != NULL && !block->empty() && std::count(block->begin(), block->end(), 0) == chunk_cells) {
+          std::vector<Uint8>().swap(*block);
         }
-        filledCircleRGBA(water_surface, x, y, radius, 0xFB, 0xFE, 0xFC, 0x80);
       }
     }
   }
-  else if (a1 == -1 || a2 == -1) {
-    //Failed somehow, these should have been changed
-    SDL_FillRect(water_surface, NULL, surface_color);
+  return packed;
+}
+
+void CellGrid::freeze(CellGrid &copy) {
+  //Make 'copy' the same as this without copying any cells; whichever of
+  //the two writes to a chunk first gets its own bytes then. Speeds aren't
+  //copied; SandGrid::snapshot copies them itself.
+  copy.width = width;
+  copy.height = height;
+  copy.chunks_across = chunks_across;
+  copy.chunks_down = chunks_down;
+  copy.chunks.resize(chunks.size());
+  for (size_t i = 0; i < chunks.size(); i++) {
+    chunks[i].freeze(copy.chunks[i]);
   }
-  else {
-    //TODO: Fancy bezier drawing
-    //bezierColor(water_surface, vx, vy, n, 5, surface_color);
-    int x1 = horizontal(a1)*block_pixel_size;
-    int y1 = vertical(a1)*block_pixel_size;
-    int x2 = horizontal(a2)*block_pixel_size;
-    int y2 = vertical(a2)*block_pixel_size;
-    int xm = 0.5*block_pixel_size;
-    int ym = 0.5*block_pixel_size;
-    aalineColor(water_surface,
-      x1, y1,
-      xm, ym,
-      surface_color);
-    aalineColor(water_surface,
-      xm, ym,
-      x2, y2,
-      surface_color);
-    if (under != -1) {
-      //dump water
-      int xf = ((0.5+horizontal(under))/2.0)*block_pixel_size;
-      int yf = ((0.5+vertical(under))/2.0)*block_pixel_size;
-      retardo_flood_fill(water_surface, xf, yf, under_water);
-      //filledCircleRGBA(water_surface, xf, yf, 3, 0xFF, 0xFF, 0xFF, 0xFF); //where we flood fill from
+  copy.dense_count = dense_count;
+  copy.written.resize(chunks.size());
+  copy.written.add_all();
+  copy.use_speeds(false);
+  copy.ticks = ticks;
+}
+
+void CellGrid::freeze_changes(CellGrid &copy, const std::vector<int> &look_at, std::vector<int> &changed, std::vector<Chunk> &was) {
+  //freeze() for a copy that was frozen from this before, where only the
+  //chunks in 'look_at' can have changed since: those that did get frozen
+  //again, and what the copy had for them is swapped out into 'was', with
+  //their indices in 'changed'. put_back() undoes it. A chunk that was only
+  //recopied (the grids swap every other tick) doesn't count as changed.
+  changed.clear();
+  for (size_t n = 0; n < look_at.size(); n++) {
+    int i = look_at[n];
+    if (!chunks[i].same_as(copy.chunks[i]) && !same_cells(copy, chunk_region(i))) {
+      changed.push_back(i);
     }
-    else {
-      std::cerr << "Note: 'under' not set." << std::endl;
+  }
+  was.clear();
+  was.resize(changed.size()); //plain air, cheap to make
+  for (size_t i = 0; i < changed.size(); i++) {
+    was[i].swap(copy.chunks[changed[i]]);
+    chunks[changed[i]].freeze(copy.chunks[changed[i]]);
+    copy.dense_count += copy.chunks[changed[i]].is_dense() - was[i].is_dense();
+    copy.written.add(changed[i]);
+  }
+  copy.ticks = ticks;
+}
+
+void CellGrid::put_back(const std::vector<int> &changed, std::vector<Chunk> &was) {
+  //Swaps 'was' back in, see freeze_changes()
+  for (size_t i = 0; i < changed.size(); i++) {
+    chunks[changed[i]].swap(was[i]);
+    dense_count += chunks[changed[i]].is_dense() - was[i].is_dense();
+    written.add(changed[i]);
+  }
+}
+
+void CellGrid::clear() {
+  //All air, and nothing shared with anybody any more
+  for (size_t i = 0; i < chunks.size(); i++) {
+    if (!speeds.empty()) {
+      std::vector<Uint8>().swap(speeds[i]);
+    }
+    if (!chunks[i].is_uniform(AIR)) {
+      dense_count -= chunks[i].is_dense();
+      chunks[i].fill(AIR);
+      written.add(i);
     }
   }
+}
+
+size_t CellGrid::bytes() const {
+  size_t size = sizeof(*this) + speeds.size()*sizeof(speeds[0]);
+  for (size_t i = 0; i < chunks.size(); i++) {
+    size += chunks[i].bytes();
+  }
+  for (size_t i = 0; i < speeds.size(); i++) {
+    size += speeds[i].capacity();
+  }
+  return size;
+}
 
+void CellGrid::changes_since(const CellGrid &old, std::vector<CellChange> &out) const {
+  //Every cell that isn't what it is in 'old', which has to be the same
+  //size. Chunks that are plainly the same (see Chunk::same_as) are skipped,
+  //so against a frozen copy this costs about as much as what changed.
+  for (int i = 0; i < chunk_count(); i++) {
+    changes_since(old, i, out);
+  }
+}
+
+void CellGrid::changes_since(const CellGrid &old, int i, std::vector<CellChange> &out) const {
+  //The same for just chunk i
+  const Chunk &chunk = chunks[i];
+  const Chunk &was = old.chunks[i];
+  if (chunk.same_as(was)) return;
+  Region whole = chunk_region(i);
+  for (int y = whole.y0; y <= whole.y1; y++) {
+    for (int x = whole.x0; x <= whole.x1; x++) {
+      int n = chunk_index(x, y);
+      CellType c = chunk.get(n), w = was.get(n);
+      if (c != w) {
+        CellChange change = {x, y, (Uint8)w, (Uint8)c};
+        out.push_back(change);
+      }
+    }
+  }
 }
 
+void CellGrid::count_cells(long long *counts, int types) const {
+  //Adds how many there are of each cell type below 'types' to counts
+  for (int i = 0; i < chunk_count(); i++) {
+    count_chunk(i, counts, types);
+  }
+}
 
+void CellGrid::count_chunk(int i, long long *counts, int types) const {
+  //The same for just chunk i
+  const Chunk &chunk = chunks[i];
+  Region whole = chunk_region(i);
+  if (chunk.is_uniform()) {
+    int c = chunk.get(0);
+    if (c < types) {
+      counts[c] += (whole.x1 - whole.x0 + 1)*(whole.y1 - whole.y0 + 1);
+    }
+    return;
+  }
+  for (int y = whole.y0; y <= whole.y1; y++) {
+    for (int x = whole.x0; x <= whole.x1; x++) {
+      int c = chunk.get(chunk_index(x, y));
+      if (c < types) counts[c]++;
+    }
+  }
+}
 
+long long CellGrid::count_different(const CellGrid &other, Region r) const {
+  //How many cells in r aren't the same in both
+  r = r.clip(Region(0, 0, width-1, height-1));
+  long long count = 0;
+  for (int cy = r.y0 >> chunk_shift; cy <= r.y1 >> chunk_shift && !r.empty(); cy++) {
+    for (int cx = r.x0 >> chunk_shift; cx <= r.x1 >> chunk_shift; cx++) {
+      const Chunk &mine = chunks[cy*chunks_across + cx];
+      const Chunk &theirs = other.chunks[cy*chunks_across + cx];
+      if (mine.same_as(theirs)) continue;
+      Region part = chunk_region(cx, cy).clip(r);
+      for (int y = part.y0; y <= part.y1; y++) {
+        for (int x = part.x0; x <= part.x1; x++) {
+          int i = chunk_index(x, y);
+          count += mine.get(i) != theirs.get(i);
+        }
+      }
+    }
+  }
+  return count;
+}
 
-void CellGrid::draw(SDL_Surface *surface) {
-  for (int x = 0; x < grid_size; x++) {
-    for (int y = 0; y < grid_size; y++) {
-      SDL_Rect rect;
-      rect.x = x*block_pixel_size+1;
-      rect.y = y*block_pixel_size+1;
-      rect.w = block_pixel_size;
-      rect.h = block_pixel_size;
-      CellType cell_type = get(x, y);
-      if ((block_pixel_size >= 3) && cell_type == EXPOSED_WATER) {
-        draw_active_water(Coord(x, y));
-        SDL_BlitSurface(water_surface, NULL, surface, &rect);
+void CellGrid::copy_region(const CellGrid &src, Region r) {
+  //Cells only. Whole chunks are copied as they are, packed or not.
+  r = r.clip(Region(0, 0, width-1, height-1));
+  if (r.empty()) return;
+  for (int cy = r.y0 >> chunk_shift; cy <= r.y1 >> chunk_shift; cy++) {
+    for (int cx = r.x0 >> chunk_shift; cx <= r.x1 >> chunk_shift; cx++) {
+      Chunk &to = chunks[cy*chunks_across + cx];
+      const Chunk &from = src.chunks[cy*chunks_across + cx];
+      Region whole = chunk_region(cx, cy), part = whole.clip(r);
+      if (to.same_as(from)) continue;
+      written.add(cy*chunks_across + cx);
+      if (part == whole) {
+        dense_count += from.is_dense() - to.is_dense();
+        to = from;
+        continue;
       }
-      else {
-        SDL_FillRect(surface, &rect, CellData::color(cell_type));
+      Uint8 *cells = expand(to);
+      const Uint8 *src_cells = from.dense_cells();
+      for (int y = part.y0; y <= part.y1; y++) {
+        int i = chunk_index(part.x0, y);
+        if (src_cells != NULL) {
+          memcpy(cells + i, src_cells + i, part.x1 - part.x0 + 1);
+        }
+        else {
+          for (int x = part.x0; x <= part.x1; x++, i++) {
+            cells[i] = from.get(i);
+          }
+        }
+      }
+    }
+  }
+}
+
+bool CellGrid::same_cells(const CellGrid &other, Region r) const {
+  r = r.clip(Region(0, 0, width-1, height-1));
+  if (r.empty()) return true;
+  for (int cy = r.y0 >> chunk_shift; cy <= r.y1 >> chunk_shift; cy++) {
+    for (int cx = r.x0 >> chunk_shift; cx <= r.x1 >> chunk_shift; cx++) {
+      const Chunk &mine = chunks[cy*chunks_across + cx];
+      const Chunk &theirs = other.chunks[cy*chunks_across + cx];
+      if (mine.same_as(theirs)) continue;
+      Region part = chunk_region(cx, cy).clip(r);
+      const Uint8 *p = mine.dense_cells(), *q = theirs.dense_cells();
+      for (int y = part.y0; y <= part.y1; y++) {
+        int i = chunk_index(part.x0, y);
+        if (p != NULL && q != NULL) {
+          if (memcmp(p + i, q + i, part.x1 - part.x0 + 1)) return false;
+          continue;
+        }
+        for (int x = part.x0; x <= part.x1; x++, i++) {
+          if (mine.get(i) != theirs.get(i)) return false;
+        }
       }
     }
   }
+  return true;
 }
 
 
@@ -266,7 +483,7 @@ void CellGrid::draw(SDL_Surface *surface) {
 
 
 
-CellBox::CellBox(CellGrid &src, Coord w) {
+CellBox::CellBox(const CellGrid &src, Coord w) {
   up = src.get(w.up());
   down = src.get(w.down());
   left = src.get(w.left());
@@ -274,7 +491,7 @@ CellBox::CellBox(CellGrid &src, Coord w) {
 }
 
 
-CellBox::CellBox(CellGrid &src, Coord w, CellType d_up, CellType d_down, CellType d_left, CellType d_right) {
+CellBox::CellBox(const CellGrid &src, Coord w, CellType d_up, CellType d_down, CellType d_left, CellType d_right) {
   up = src.get(w.up(), d_up);
   down = src.get(w.down(), d_down);
   left = src.get(w.left(), d_left);
@@ -2,40 +2,151 @@
 #ifndef CELLGRID_H
 #define CELLGRID_H
 
+#include <vector>
+
 #include "CellData.h"
+#include "Chunk.h"
 #include "common.h"
 
+//One cell that's different from last time, see CellGrid::changes_since
+struct CellChange {
+  int x, y;
+  Uint8 was, is;
+};
+
+/*
+Just the cells; copies share nothing, or only what Chunk shares. Drawing
+is GridRenderer's job.
+*/
 class CellGrid {
 private:
-  CellType grid[grid_size][grid_size];
-  SDL_Surface *water_surface;
-  
-  void draw_active_water(Coord here);
-  inline bool in_bounds(int x, int y) {
-    if (x < 0 || y < 0 || x >= grid_size || y >= grid_size) {
+  int width, height;
+  int chunks_across, chunks_down;
+  std::vector<Chunk> chunks; //row after row
+  std::vector<std::vector<Uint8> > speeds; //a block per chunk, empty while it's all still; none unless use_speeds()
+  ChunkSet written; //chunks with a cell that changed since forget_written()
+  int dense_count; //chunks that are plain bytes
+
+  inline bool in_bounds(int x, int y) const {
+    if (x < 0 || y < 0 || x >= width || y >= height) {
       return false;
     }
     return true;
   }
+  inline int chunk_number(int x, int y) const {
+    return (y >> chunk_shift)*chunks_across + (x >> chunk_shift);
+  }
+  inline Chunk &chunk_at(int x, int y) {
+    return chunks[chunk_number(x, y)];
+  }
+  inline const Chunk &chunk_at(int x, int y) const {
+    return chunks[chunk_number(x, y)];
+  }
+  static inline int chunk_index(int x, int y) {
+    return ((y & (chunk_size-1)) << chunk_shift) + (x & (chunk_size-1));
+  }
+  Region chunk_region(int cx, int cy) const;
+  inline Uint8 *expand(Chunk &chunk) {
+    //Its bytes, to write to, counted if they're new
+    dense_count += !chunk.is_dense();
+    return chunk.dense();
+  }
+  //Cells that are about to turn into something else stop falling
+  void still(int n, int i, const Uint8 *in, int count);
+  void still(int n, int i, CellType c, int count);
 
 public:
-  CellGrid();
-  ~CellGrid();
+  CellGrid(int w = grid_size, int h = grid_size);
+  CellGrid &operator=(const CellGrid &other);
+  void swap(CellGrid &other);
 
-  CellType get(int x, int y, CellType default_type = ROCK);
-  
+  inline CellType get(int x, int y, CellType default_type = ROCK) const {
+    if (in_bounds(x, y)) {
+      return chunk_at(x, y).get(chunk_index(x, y));
+    }
+    return default_type;
+  }
 
   inline void set(int x, int y, CellType c) {
     if (in_bounds(x, y)) {
-      grid[x][y] = c;
+      int n = chunk_number(x, y);
+      bool was_dense = chunks[n].is_dense();
+      if (chunks[n].set(chunk_index(x, y), c)) {
+        written.add(n);
+        dense_count += !was_dense;
+        if (!speeds.empty() && !speeds[n].empty()) {
+          speeds[n][chunk_index(x, y)] = 0;
+        }
+      }
     }
   }
 
-  inline CellType get(Coord p, CellType default_type = ROCK) { return get(p.x, p.y, default_type); }
+  void fill_span(int x0, int x1, int y, CellType c);
+
+  //How fast the cell at (x, y) is falling, in cells a tick, only kept once
+  //use_speeds() is called. A chunk only gets a block of speeds once
+  //something in it falls. Setting a cell to something else stops it.
+  inline int speed(int x, int y) const {
+    if (speeds.empty() || !in_bounds(x, y)) return 0;
+    const std::vector<Uint8> &block = speeds[chunk_number(x, y)];
+    return block.empty() ? 0 : block[chunk_index(x, y)];
+  }
+  inline void set_speed(int x, int y, int s) {
+    if (speeds.empty() || !in_bounds(x, y)) return;
+    std::vector<Uint8> &block = speeds[chunk_number(x, y)];
+    if (block.empty()) {
+      if (s == 0) return;
+      block.assign(chunk_cells, 0);
+    }
+    block[chunk_index(x, y)] = s;
+  }
+  void use_speeds(bool on);
+  inline bool has_speeds() const { return !speeds.empty(); }
+  void copy_speeds(const CellGrid &src, Region r);
+  //Row y's speeds, like read_row; write_speed_row needs use_speeds() first
+  void read_speed_row(int y, Uint8 *out) const;
+  void write_speed_row(int y, const Uint8 *in);
+
+  inline CellType get(Coord p, CellType default_type = ROCK) const { return get(p.x, p.y, default_type); }
   inline void set(Coord p, CellType c) { set(p.x, p.y, c); }
 
   
-  void draw(SDL_Surface *surface);
+  bool same_cells(const CellGrid &other) const;
+  bool same_cells(const CellGrid &other, Region r) const;
+  void copy_region(const CellGrid &src, Region r);
+  int compact(Region keep, const CellGrid *unless_changed = NULL);
+  void freeze(CellGrid &copy);
+  void freeze_changes(CellGrid &copy, const std::vector<int> &chunks, std::vector<int> &changed, std::vector<Chunk> &was);
+  void put_back(const std::vector<int> &changed, std::vector<Chunk> &was);
+  void clear();
+  size_t bytes() const;
+  inline int dense_chunks() const { return dense_count; }
+  void count_cells(long long *counts, int types) const;
+  void count_chunk(int i, long long *counts, int types) const;
+  long long count_different(const CellGrid &other, Region r) const;
+  void changes_since(const CellGrid &old, std::vector<CellChange> &out) const;
+  void changes_since(const CellGrid &old, int i, std::vector<CellChange> &out) const;
+
+  inline int get_width() const { return width; }
+  inline int get_height() const { return height; }
+  inline int chunk_count() const { return chunks.size(); }
+  Region chunk_region(int i) const;
+
+  //Every chunk that had a cell set to something else, or might have; a
+  //whole copy over this one counts as all of them
+  inline const ChunkSet &written_chunks() const { return written; }
+  inline void forget_written() { written.clear(); }
+
+  //Row y as one byte per cell, width of them
+  void read_row(int y, Uint8 *out) const;
+  void write_row(int y, const Uint8 *in);
+  //Every cell in r, row after row; anything off the grid is default_type
+  void read_region(Region r, Uint8 *out, CellType default_type = ROCK) const;
+  //Chunk i's cells into a flat copy of the whole grid, cell (x, y) at
+  //out[y*stride + x]
+  void read_chunk(int i, Uint8 *out, int stride) const;
+  //And back: the cells of r from a flat copy laid out the same way
+  void write_flat(Region r, const Uint8 *in, int stride);
 
   int ticks;
 };
@@ -43,8 +154,8 @@ public:
 struct CellBox {
 public:
   CellType up, down, left, right;
-  CellBox(CellGrid &src, Coord w);
-  CellBox(CellGrid &src, Coord w, CellType d_up, CellType d_down, CellType d_left, CellType d_right);
+  CellBox(const CellGrid &src, Coord w);
+  CellBox(const CellGrid &src, Coord w, CellType d_up, CellType d_down, CellType d_left, CellType d_right);
   bool any(CellType c);
   bool all(CellType c);
   int count(CellType c);
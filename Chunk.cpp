@@ -0,0 +1,217 @@
+
+#include "Chunk.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+Chunk::Chunk(CellType fill) : kind(UNIFORM), value(fill), block(NULL) {}
+
+Chunk::Chunk(const Chunk &other) : kind(UNIFORM), value(AIR), block(NULL) {
+  share(other);
+}
+
+Chunk &Chunk::operator=(const Chunk &other) {
+  if (this == &other) return *this;
+  if (kind == DENSE && other.kind <= SHARED) {
+    //Happens every tick, so reuse the bytes
+    if (block != other.block) {
+      memcpy(block->cells, other.block->cells, chunk_cells);
+    }
+    return *this;
+  }
+  if (kind == PACKED && other.kind == PACKED && packed == other.packed) {
+    return *this;
+  }
+  release();
+  share(other);
+  return *this;
+}
+
+Chunk::~Chunk() {
+  release();
+}
+
+void Chunk::release() {
+  if (kind <= SHARED) {
+    if (__sync_sub_and_fetch(&block->refs, 1) == 0) {
+      delete block;
+    }
+  }
+  else if (kind == PACKED) {
+    if (__sync_sub_and_fetch(&packed->refs, 1) == 0) {
+      free(packed);
+    }
+  }
+  kind = UNIFORM;
+  block = NULL;
+}
+
+void Chunk::share(const Chunk &other) {
+  //Expects to be empty. Bytes get copied; only freeze() shares them.
+  kind = other.kind;
+  value = other.value;
+  if (kind <= SHARED) {
+    kind = DENSE;
+    block = new Block;
+    block->refs = 1;
+    memcpy(block->cells, other.block->cells, chunk_cells);
+  }
+  else if (kind == PACKED) {
+    packed = other.packed;
+    __sync_add_and_fetch(&packed->refs, 1);
+  }
+}
+
+void Chunk::freeze(Chunk &copy) {
+  //Make 'copy' the same as this without copying any cells
+  if (kind > SHARED) {
+    copy = *this;
+    return;
+  }
+  copy.release();
+  kind = SHARED;
+  copy.kind = SHARED;
+  copy.block = block;
+  __sync_add_and_fetch(&block->refs, 1);
+}
+
+void Chunk::swap(Chunk &other) {
+  //Trade cells without copying or touching the reference counts
+  Uint8 k = kind, v = value;
+  Block *b = block;
+  kind = other.kind;
+  value = other.value;
+  block = other.block;
+  other.kind = k;
+  other.value = v;
+  other.block = b;
+}
+
+void Chunk::fill(CellType c) {
+  release();
+  value = c;
+}
+
+void Chunk::expand() {
+  //Make the bytes ours to write
+  if (kind == DENSE) return;
+  if (kind == SHARED && __sync_add_and_fetch(&block->refs, 0) == 1) {
+    kind = DENSE; //the snapshot's gone already
+    return;
+  }
+  Block *bytes = new Block;
+  bytes->refs = 1;
+  for (int i = 0; i < chunk_cells; i++) {
+    bytes->cells[i] = get(i);
+  }
+  release();
+  kind = DENSE;
+  block = bytes;
+}
+
+Uint8 *Chunk::dense() {
+  expand();
+  return block->cells;
+}
+
+bool Chunk::pack(int w, int h) {
+  //Only the w by h corner is inside the world, the rest can be anything.
+  //False if there are too many kinds of cell to bother.
+  if (kind > SHARED) return true;
+  const Uint8 *cells = block->cells;
+  Uint8 palette[16];
+  int count = 0;
+  Uint8 index_of[256];
+  memset(index_of, 0xFF, sizeof(index_of));
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      Uint8 c = cells[(y << chunk_shift) + x];
+      if (index_of[c] == 0xFF) {
+        if (count == 16) return false;
+        index_of[c] = count;
+        palette[count++] = c;
+      }
+    }
+  }
+  if (count == 1) {
+    fill((CellType)palette[0]);
+    return true;
+  }
+
+  int bits = count <= 2 ? 1 : count <= 4 ? 2 : 4;
+  Packed *p = (Packed *)malloc(offsetof(Packed, indices) + chunk_cells*bits/8);
+  p->refs = 1;
+  p->bits = bits;
+  memcpy(p->palette, palette, count);
+  memset(p->indices, 0, chunk_cells*bits/8);
+  for (int i = 0; i < chunk_cells; i++) {
+    int x = i & (chunk_size-1), y = i >> chunk_shift;
+    int index = (x < w && y < h) ? index_of[cells[i]] : 0;
+    int bit = i*bits;
+    p->indices[bit >> 3] |= index << (bit & 7);
+  }
+  release();
+  kind = PACKED;
+  packed = p;
+  return true;
+}
+
+bool Chunk::is_uniform(CellType c) const {
+  return kind == UNIFORM && value == c;
+}
+
+bool Chunk::same_as(const Chunk &other) const {
+  //Only the cheap answers; false means "go and look"
+  if (kind == UNIFORM && other.kind == UNIFORM) return value == other.value;
+  if (kind == PACKED && other.kind == PACKED) return packed == other.packed;
+  if (kind <= SHARED && other.kind <= SHARED) return block == other.block;
+  return false;
+}
+
+size_t Chunk::bytes() const {
+  //Including its share of anything shared
+  size_t size = sizeof(Chunk);
+  if (kind <= SHARED) {
+    size += data_bytes() / block->refs;
+  }
+  else if (kind == PACKED) {
+    size += data_bytes() / packed->refs;
+  }
+  return size;
+}
+
+size_t Chunk::data_bytes() const {
+  //The cells wherever they are, however many chunks share them
+  if (kind <= SHARED) return sizeof(Block);
+  if (kind == PACKED) return offsetof(Packed, indices) + chunk_cells*packed->bits/8;
+  return 0;
+}
+
+
+ChunkSet::ChunkSet(int chunks) : in(chunks, 0) {}
+
+void ChunkSet::resize(int chunks) {
+  in.assign(chunks, 0);
+  indices.clear();
+}
+
+void ChunkSet::add(const ChunkSet &other) {
+  //Has to be the same size
+  for (size_t i = 0; i < other.indices.size(); i++) {
+    add(other.indices[i]);
+  }
+}
+
+void ChunkSet::add_all() {
+  if (indices.size() == in.size()) return;
+  for (size_t i = 0; i < in.size(); i++) {
+    add(i);
+  }
+}
+
+void ChunkSet::clear() {
+  for (size_t i = 0; i < indices.size(); i++) {
+    in[indices[i]] = 0;
+  }
+  indices.clear();
+}
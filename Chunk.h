@@ -0,0 +1,123 @@
+
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include <stddef.h>
+#include <vector>
+
+#include "CellData.h"
+#include "common.h"
+
+const int chunk_cells = chunk_size*chunk_size;
+
+/*
+A chunk_size square of cells, kept as small as it can be. A chunk that's
+all one thing is just that cell type. A quiet one can be packed into a
+palette of the types in it plus a 1, 2 or 4 bit index per cell. Packed
+cells are shared between copies and never written; setting a cell that
+isn't already right turns the chunk back into plain bytes.
+
+Plain bytes can be shared too, with freeze(): a snapshot and the chunk it
+was taken from both point at the same bytes until one of them writes, and
+only that one gets a copy. Snapshots are read on other threads, so the
+reference counts are atomic.
+Cell (x, y) of the chunk is index (y << chunk_shift) + x.
+*/
+class Chunk {
+private:
+  struct Packed {
+    int refs;
+    int bits;
+    Uint8 palette[16];
+    Uint8 indices[1]; //really chunk_cells*bits/8 of them
+  };
+  struct Block {
+    int refs;
+    Uint8 cells[chunk_cells];
+  };
+  //DENSE and SHARED first, so one compare finds the bytes
+  enum Kind { DENSE, SHARED, UNIFORM, PACKED };
+
+  Uint8 kind;
+  Uint8 value; //UNIFORM
+  union {
+    Block *block; //DENSE, ours alone; SHARED, maybe not
+    Packed *packed; //PACKED
+  };
+
+  void release();
+  void share(const Chunk &other);
+
+public:
+  Chunk(CellType fill = AIR);
+  Chunk(const Chunk &other);
+  Chunk &operator=(const Chunk &other);
+  ~Chunk();
+
+  inline CellType get(int i) const {
+    if (kind <= SHARED) return (CellType)block->cells[i];
+    if (kind == UNIFORM) return (CellType)value;
+    int bit = i*packed->bits;
+    return (CellType)packed->palette[(packed->indices[bit >> 3] >> (bit & 7)) & ((1 << packed->bits) - 1)];
+  }
+
+  inline bool set(int i, CellType c) {
+    //True if it was something else
+    if (kind != DENSE) {
+      if (get(i) == c) return false; //stay small
+      expand();
+    }
+    else if (block->cells[i] == c) {
+      return false;
+    }
+    block->cells[i] = c;
+    return true;
+  }
+
+  void fill(CellType c);
+  void expand();
+  Uint8 *dense();
+  bool pack(int w, int h);
+  void freeze(Chunk &copy);
+  void swap(Chunk &other);
+
+  inline bool is_dense() const { return kind <= SHARED; }
+  inline bool is_uniform() const { return kind == UNIFORM; }
+  inline const Uint8 *dense_cells() const { return kind <= SHARED ? block->cells : NULL; }
+  bool is_uniform(CellType c) const;
+  bool same_as(const Chunk &other) const;
+  size_t bytes() const;
+  size_t data_bytes() const;
+};
+
+/*
+Some of a grid's chunks, by index (row after row, like CellGrid keeps
+them). Each one is in at most once, in the order it went in, so going
+over them or emptying the set costs about as much as what's in it.
+*/
+class ChunkSet {
+private:
+  std::vector<Uint8> in;
+  std::vector<int> indices;
+
+public:
+  ChunkSet(int chunks = 0);
+  void resize(int chunks); //and empty it
+  inline int size() const { return in.size(); }
+
+  inline void add(int i) {
+    if (!in[i]) {
+      in[i] = 1;
+      indices.push_back(i);
+    }
+  }
+  void add(const ChunkSet &other);
+  void add_all();
+  void clear();
+
+  inline bool contains(int i) const { return in[i]; }
+  inline bool empty() const { return indices.empty(); }
+  inline const std::vector<int> &list() const { return indices; }
+};
+
+#endif /* CHUNK_H */
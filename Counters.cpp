@@ -0,0 +1,215 @@
+
+#include "Counters.h"
+
+#include <fcntl.h>
+#include <iostream>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "CellData.h"
+
+static std::string shm_path(const char *name) {
+  //shm_open wants exactly one leading slash
+  return name[0] == '/' ? name : std::string("/") + name;
+}
+
+CounterRing::CounterRing() : mapped(false), writer(true), dump(NULL), dump_every(0) {
+  ring = new sand_counters_ring();
+  ring->magic = SAND_COUNTERS_MAGIC;
+  ring->version = SAND_COUNTERS_VERSION;
+  ring->slots = SAND_COUNTERS_SLOTS;
+  ring->record_size = sizeof(sand_tick_counters);
+}
+
+CounterRing::~CounterRing() {
+  release();
+  if (dump != NULL) {
+    fclose(dump);
+  }
+}
+
+void CounterRing::release() {
+  if (!mapped) {
+    delete ring;
+    return;
+  }
+  if (writer) {
+    ring->closed = 1;
+    shm_unlink(shm_name.c_str());
+  }
+  munmap(ring, sizeof(sand_counters_ring));
+}
+
+bool CounterRing::publish(const char *name) {
+  //Start writing into shared memory under 'name', carrying on from where we are
+  std::string path = shm_path(name);
+  int fd = shm_open(path.c_str(), O_CREAT | O_RDWR, 0644);
+  if (fd < 0) {
+    perror("shm_open");
+    return false;
+  }
+  void *memory = MAP_FAILED;
+  if (ftruncate(fd, sizeof(sand_counters_ring)) == 0) {
+    memory = mmap(NULL, sizeof(sand_counters_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (memory == MAP_FAILED) {
+    perror("mmap");
+    shm_unlink(path.c_str());
+    return false;
+  }
+  sand_counters_ring *shared = (sand_counters_ring *)memory;
+  memcpy(shared, ring, sizeof(sand_counters_ring));
+  shared->closed = 0;
+  release();
+  ring = shared;
+  shm_name = path;
+  mapped = true;
+  writer = true;
+  return true;
+}
+
+bool CounterRing::attach(const char *name) {
+  //Read somebody else's ring
+  std::string path = shm_path(name);
+  int fd = shm_open(path.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    perror("shm_open");
+    return false;
+  }
+  void *memory = mmap(NULL, sizeof(sand_counters_ring), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+  sand_counters_ring *shared = (sand_counters_ring *)memory;
+  if (shared->magic != SAND_COUNTERS_MAGIC || shared->version != SAND_COUNTERS_VERSION
+      || shared->record_size != sizeof(sand_tick_counters)) {
+    std::cerr << path << " isn't a counter ring this version understands" << std::endl;
+    munmap(memory, sizeof(sand_counters_ring));
+    return false;
+  }
+  release();
+  ring = shared;
+  shm_name = path;
+  mapped = true;
+  writer = false;
+  return true;
+}
+
+bool CounterRing::dump_to(const char *path, int every) {
+  dump = fopen(path, "w");
+  if (dump == NULL) {
+    perror(path);
+    return false;
+  }
+  dump_every = every > 0 ? every : 1;
+  print_header(dump);
+  return true;
+}
+
+void CounterRing::push(const sand_tick_counters &counters) {
+  sand_tick_counters &record = ring->records[ring->head % SAND_COUNTERS_SLOTS];
+  unsigned long long sequence = record.sequence;
+  record.sequence = sequence + 1;
+  __sync_synchronize();
+  memcpy((char *)&record + sizeof(record.sequence), (const char *)&counters + sizeof(counters.sequence),
+      sizeof(record) - sizeof(record.sequence));
+  __sync_synchronize();
+  record.sequence = sequence + 2;
+  __sync_synchronize();
+  ring->head = ring->head + 1;
+
+  if (dump != NULL && ring->head % dump_every == 0) {
+    print(dump, counters);
+    fflush(dump);
+  }
+}
+
+Uint64 CounterRing::head() const {
+  return ring->head;
+}
+
+bool CounterRing::closed() const {
+  return ring->closed != 0;
+}
+
+bool CounterRing::read(Uint64 index, sand_tick_counters &out) const {
+  //False if record 'index' isn't there (yet, or any more)
+  Uint64 newest = ring->head;
+  if (index >= newest || newest - index > SAND_COUNTERS_SLOTS) return false;
+  const sand_tick_counters &record = ring->records[index % SAND_COUNTERS_SLOTS];
+  for (int tries = 0; tries < 100; tries++) {
+    unsigned long long before = record.sequence;
+    __sync_synchronize();
+    memcpy(&out, (const void *)&record, sizeof(out));
+    __sync_synchronize();
+    if (before % 2 == 0 && record.sequence == before) {
+      //Still the record we wanted, not one written over it since?
+      return ring->head - index <= SAND_COUNTERS_SLOTS;
+    }
+  }
+  return false;
+}
+
+void CounterRing::print_header(FILE *out) {
+  fprintf(out, "tick");
+  for (int c = FIRST_CELL_TYPE; c < CELL_TYPE_COUNT && c < SAND_COUNTERS_CELL_TYPES; c++) {
+    //Cell names can have spaces in them
+    fputc(' ', out);
+    for (const wchar_t *s = CellData::name((CellType)c); *s; s++) {
+      fputc(*s == ' ' ? '_' : (char)*s, out);
+    }
+  }
+  fprintf(out, " changed water_moved water_bodies dense_chunks clones destroys\n");
+}
+
+void CounterRing::print(FILE *out, const sand_tick_counters &counters) {
+  fprintf(out, "%lld", counters.tick);
+  for (int c = FIRST_CELL_TYPE; c < CELL_TYPE_COUNT && c < SAND_COUNTERS_CELL_TYPES; c++) {
+    fprintf(out, " %lld", counters.cells[c]);
+  }
+  fprintf(out, " %lld %lld %lld %lld %lld %lld\n", counters.changed, counters.water_moved,
+      counters.water_bodies, counters.dense_chunks, counters.clones, counters.destroys);
+}
+
+CellCensus::CellCensus() {
+  reset();
+}
+
+void CellCensus::reset() {
+  //Count everything again next time
+  counted = false;
+}
+
+void CellCensus::recount(const CellGrid &cells, int i) {
+  long long *mine = &counts[i*(size_t)SAND_COUNTERS_CELL_TYPES];
+  for (int c = 0; c < SAND_COUNTERS_CELL_TYPES; c++) {
+    totals[c] -= mine[c];
+    mine[c] = 0;
+  }
+  cells.count_chunk(i, mine, SAND_COUNTERS_CELL_TYPES);
+  for (int c = 0; c < SAND_COUNTERS_CELL_TYPES; c++) {
+    totals[c] += mine[c];
+  }
+}
+
+void CellCensus::update(const CellGrid &cells, const ChunkSet &changed) {
+  //'changed' has every chunk that might be different since last time
+  int chunks = cells.chunk_count();
+  if (!counted || counts.size() != chunks*(size_t)SAND_COUNTERS_CELL_TYPES) {
+    counts.assign(chunks*(size_t)SAND_COUNTERS_CELL_TYPES, 0);
+    memset(totals, 0, sizeof(totals));
+    for (int i = 0; i < chunks; i++) {
+      recount(cells, i);
+    }
+    counted = true;
+    return;
+  }
+  const std::vector<int> &list = changed.list();
+  for (size_t i = 0; i < list.size(); i++) {
+    recount(cells, list[i]);
+  }
+}
@@ -0,0 +1,65 @@
+
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <SDL/SDL.h>
+
+#include "CellGrid.h"
+#include "sand_counters.h"
+
+/*
+The ring of per-tick counters from sand_counters.h. It starts out private
+to this process; publish() moves it into shared memory for monitors, and
+dump_to() also writes every so many records to a file.
+*/
+class CounterRing {
+private:
+  sand_counters_ring *ring;
+  std::string shm_name;
+  bool mapped, writer;
+  FILE *dump;
+  int dump_every;
+
+  CounterRing(const CounterRing &);
+  void release();
+
+public:
+  CounterRing();
+  ~CounterRing();
+  bool publish(const char *name);
+  bool attach(const char *name);
+  bool dump_to(const char *path, int every);
+
+  void push(const sand_tick_counters &counters);
+  Uint64 head() const;
+  bool closed() const;
+  bool read(Uint64 index, sand_tick_counters &out) const;
+
+  static void print_header(FILE *out);
+  static void print(FILE *out, const sand_tick_counters &counters);
+};
+
+/*
+How much of each cell type a world has, for the counters. Kept chunk by
+chunk, so a tick only recounts the chunks it changed.
+*/
+class CellCensus {
+private:
+  std::vector<long long> counts; //SAND_COUNTERS_CELL_TYPES per chunk
+  long long totals[SAND_COUNTERS_CELL_TYPES];
+  bool counted; //everything's been counted once
+
+  void recount(const CellGrid &cells, int i);
+
+public:
+  CellCensus();
+  void reset();
+  void update(const CellGrid &cells, const ChunkSet &changed);
+  inline const long long *cells() const { return totals; }
+};
+
+#endif /* COUNTERS_H */
@@ -0,0 +1,141 @@
+
+#include "Diff.h"
+#include "Random.h"
+
+Divergence::Divergence() : what("cells"), tick(-1), cell(-1, -1), expected(BAD_CELL_TYPE), got(BAD_CELL_TYPE) {}
+
+static const Uint64 fnv_offset = 0xCBF29CE484222325ULL, fnv_prime = 0x100000001B3ULL;
+
+static Uint64 hash_bytes(Uint64 h, const Uint8 *bytes, int n) {
+  for (int i = 0; i < n; i++) {
+    h = (h ^ bytes[i]) * fnv_prime;
+  }
+  return h;
+}
+
+Uint64 hash_cells(const CellGrid &cells) {
+  //FNV-1a over the size and every cell
+  Uint64 h = fnv_offset;
+  h = (h ^ cells.get_width()) * fnv_prime;
+  h = (h ^ cells.get_height()) * fnv_prime;
+  std::vector<Uint8> row(cells.get_width());
+  for (int y = 0; y < cells.get_height(); y++) {
+    cells.read_row(y, &row[0]);
+    h = hash_bytes(h, &row[0], row.size());
+  }
+  return h;
+}
+
+Uint64 hash_cells(const Uint8 *cells, int width, int height) {
+  //The same for cells in a flat array, row after row
+  Uint64 h = fnv_offset;
+  h = (h ^ width) * fnv_prime;
+  h = (h ^ height) * fnv_prime;
+  return hash_bytes(h, cells, width*height);
+}
+
+bool first_difference(const Uint8 *expected, const CellGrid &got, Coord &where) {
+  //In reading order; false if they're the same
+  for (int y = 0; y < got.get_height(); y++) {
+    for (int x = 0; x < got.get_width(); x++) {
+      if (expected[y*got.get_width() + x] != got.get(x, y)) {
+        where = Coord(x, y);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void random_scene(EditBatch &batch, int width, int height, Uint64 seed) {
+  //Half air, the rest a mix of everything, with a rock floor so things pile up
+  Random random(seed);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      int r = random.at(0, x, y) % 40;
+      CellType cell_type = r < 20 ? AIR
+        : r < 25 ? SAND
+        : r < 28 ? ROCK
+        : r < 34 ? EXPOSED_WATER
+        : r < 38 ? INACTIVE_WATER
+        : r < 39 ? CLONER
+        : DESTROYER;
+      batch.point(Coord(x, y), cell_type);
+    }
+  }
+  batch.span(0, width-1, height-1, ROCK);
+}
+
+struct Replay {
+  //What a journal's subscriber has seen, as a flat copy of the world
+  int width;
+  std::vector<Uint8> cells;
+};
+
+static void replay(int tick, const CellChange *changes, int count, void *copy) {
+  Replay &replay = *(Replay *)copy;
+  for (int i = 0; i < count; i++) {
+    replay.cells[changes[i].y*replay.width + changes[i].x] = changes[i].is;
+  }
+}
+
+static bool same(const Uint8 *expected, const CellGrid &got, Divergence &where, const char *what) {
+  if (hash_cells(expected, got.get_width(), got.get_height()) == hash_cells(got)) {
+    return true;
+  }
+  where.what = what;
+  where.tick = got.ticks;
+  if (first_difference(expected, got, where.cell)) {
+    where.expected = (CellType)expected[where.cell.y*got.get_width() + where.cell.x];
+    where.got = got.get(where.cell);
+  }
+  return false;
+}
+
+bool diff_run(ReferenceGrid &reference, SandGrid &candidate, int ticks, Divergence &where) {
+  const int rewind_every = 100, rewind_by = 40;
+  int width = reference.get_width(), height = reference.get_height();
+  Replay copy;
+  copy.width = width;
+  copy.cells.assign(width*(size_t)height, AIR);
+  DeltaJournal journal;
+  journal.subscribe(replay, &copy);
+  candidate.set_journal(&journal);
+  //Speeds aren't kept (see TickHistory), so with VELOCITY_RULES a rewound
+  //world doesn't come back the same
+  TickHistory history(rewind_by, (size_t)1 << 30);
+  bool rewinds = reference.get_rules() != VELOCITY_RULES;
+  if (rewinds) {
+    candidate.set_history(&history);
+  }
+  std::vector<Uint64> hashes(1, hash_cells(reference.cells(), width, height)); //by tick
+
+  bool ok = true;
+  for (int i = 0; i < ticks && ok; i++) {
+    reference.update();
+    candidate.update(true);
+    hashes.push_back(hash_cells(reference.cells(), width, height));
+    ok = same(reference.cells(), candidate.current(), where, "cells")
+      && same(&copy.cells[0], candidate.current(), where, "the journal");
+    if (ok && rewinds && reference.ticks() % rewind_every == 0) {
+      //Back a way and forward again, through the same ticks
+      int to = reference.ticks() - rewind_by;
+      ok = candidate.rewind(to) && candidate.ticks() == to;
+      while (ok && candidate.ticks() < reference.ticks()) {
+        ok = hash_cells(candidate.current()) == hashes[candidate.ticks()];
+        candidate.update(true);
+      }
+      ok = ok && same(reference.cells(), candidate.current(), where, "a rewind");
+      if (!ok && where.tick < 0) {
+        where.what = "a rewind";
+        where.tick = candidate.ticks();
+      }
+    }
+    if (reference.is_settled() && candidate.is_settled()) {
+      break; //Nothing more will happen to either
+    }
+  }
+  candidate.set_journal(NULL);
+  candidate.set_history(NULL);
+  return ok;
+}
@@ -0,0 +1,33 @@
+
+#ifndef DIFF_H
+#define DIFF_H
+
+#include "Physics.h"
+#include "Reference.h"
+
+/*
+Differential testing: the reference engine (see Reference.h) and a
+SandGrid set up however we like get the same scene and tick side by side.
+Their cells are hashed every tick, and the first tick they disagree is
+reported along with the first cell that differs.
+
+The candidate also keeps a journal and a history while it runs. What the
+journal hands out has to add up to its cells every tick, and every so often
+it rewinds a way and has to come back through the same ticks.
+*/
+
+struct Divergence {
+  const char *what; //which check failed
+  int tick;
+  Coord cell;
+  CellType expected, got;
+  Divergence();
+};
+
+Uint64 hash_cells(const CellGrid &cells);
+Uint64 hash_cells(const Uint8 *cells, int width, int height);
+bool first_difference(const Uint8 *expected, const CellGrid &got, Coord &where);
+void random_scene(EditBatch &batch, int width, int height, Uint64 seed);
+bool diff_run(ReferenceGrid &reference, SandGrid &candidate, int ticks, Divergence &where);
+
+#endif /* DIFF_H */
@@ -0,0 +1,128 @@
+
+#include "Edits.h"
+
+#include <algorithm>
+#include <stack>
+#include <math.h>
+#include <stdlib.h>
+
+void EditBatch::span(int x0, int x1, int y, CellType cell_type) {
+  if (x0 > x1) std::swap(x0, x1);
+  if (edits.size()) {
+    //Glue onto the last span if it's on the same row; lines make lots of these
+    Edit &last = edits.back();
+    if (!last.flood && last.y == y && last.cell_type == cell_type
+        && x0 <= last.x1 + 1 && x1 >= last.x0 - 1) {
+      last.x0 = std::min(last.x0, x0);
+      last.x1 = std::max(last.x1, x1);
+      return;
+    }
+  }
+  Edit e = {x0, x1, y, cell_type, false};
+  edits.push_back(e);
+}
+
+void EditBatch::point(Coord p, CellType cell_type) {
+  span(p.x, p.x, p.y, cell_type);
+}
+
+void EditBatch::line(Coord a, Coord b, CellType cell_type, int radius) {
+  //Bresenham, so fast strokes don't leave gaps
+  int dx = abs(b.x - a.x), dy = -abs(b.y - a.y);
+  int sx = sign(b.x - a.x), sy = sign(b.y - a.y);
+  int err = dx + dy;
+  while (true) {
+    if (radius > 0) {
+      circle(a, radius, cell_type);
+    }
+    else {
+      point(a, cell_type);
+    }
+    if (a == b) break;
+    int e2 = 2*err;
+    if (e2 >= dy) {
+      err += dy;
+      a.x += sx;
+    }
+    if (e2 <= dx) {
+      err += dx;
+      a.y += sy;
+    }
+  }
+}
+
+void EditBatch::rect(Coord a, Coord b, CellType cell_type) {
+  for (int y = std::min(a.y, b.y); y <= std::max(a.y, b.y); y++) {
+    span(a.x, b.x, y, cell_type);
+  }
+}
+
+void EditBatch::circle(Coord center, int radius, CellType cell_type) {
+  for (int dy = -radius; dy <= radius; dy++) {
+    int dx = (int)sqrt((float)(radius*radius - dy*dy));
+    span(center.x - dx, center.x + dx, center.y + dy, cell_type);
+  }
+}
+
+void EditBatch::flood_replace(Coord p, CellType cell_type) {
+  //Needs to look at the grid, so it happens in apply()
+  Edit e = {p.x, p.x, p.y, cell_type, true};
+  edits.push_back(e);
+}
+
+bool EditBatch::empty() {
+  return edits.empty();
+}
+
+Region EditBatch::bounds(Region world) {
+  //Everything that might get written, as far as we can tell without the grid
+  Region r(0, 0, -1, -1);
+  for (std::vector<Edit>::iterator e = edits.begin(); e != edits.end(); e++) {
+    if (e->flood) return world;
+    r = r.merge(Region(e->x0, e->y, e->x1, e->y));
+  }
+  return r.clip(world);
+}
+
+void EditBatch::clear() {
+  edits.clear();
+}
+
+void EditBatch::apply(CellGrid &grid) {
+  for (std::vector<Edit>::iterator e = edits.begin(); e != edits.end(); e++) {
+    if (e->flood) {
+      flood_replace(grid, e->x0, e->y, e->cell_type);
+    }
+    else {
+      grid.fill_span(e->x0, e->x1, e->y, e->cell_type);
+    }
+  }
+}
+
+void EditBatch::flood_replace(CellGrid &grid, int x, int y, CellType cell_type) {
+  //Same scanline fill as retardo_flood_fill, but on cells
+  CellType orig = grid.get(x, y, BAD_CELL_TYPE);
+  if (orig == BAD_CELL_TYPE || orig == cell_type) return;
+  std::stack<Coord> s;
+  s.push(Coord(x, y));
+  while (s.size()) {
+    x = s.top().x;
+    y = s.top().y;
+    s.pop();
+    if (grid.get(x, y, BAD_CELL_TYPE) != orig) continue;
+    int x0 = x, x1 = x;
+    while (grid.get(x0-1, y, BAD_CELL_TYPE) == orig) x0--;
+    while (grid.get(x1+1, y, BAD_CELL_TYPE) == orig) x1++;
+    grid.fill_span(x0, x1, y, cell_type);
+    for (int dy = -1; dy <= 1; dy += 2) {
+      bool in_span = false;
+      for (x = x0; x <= x1; x++) {
+        bool eq_orig = grid.get(x, y+dy, BAD_CELL_TYPE) == orig;
+        if (!in_span && eq_orig) {
+          s.push(Coord(x, y+dy));
+        }
+        in_span = eq_orig;
+      }
+    }
+  }
+}
@@ -0,0 +1,38 @@
+
+#ifndef EDITS_H
+#define EDITS_H
+
+#include <vector>
+
+#include "CellGrid.h"
+
+/*
+A batch of edits, collected as horizontal spans and written into a grid in
+one go between ticks. All coordinates are inclusive.
+*/
+class EditBatch {
+private:
+  struct Edit {
+    int x0, x1, y;
+    CellType cell_type;
+    bool flood; //flood-replace starting at (x0, y) instead of a span
+  };
+  std::vector<Edit> edits;
+
+  void flood_replace(CellGrid &grid, int x, int y, CellType cell_type);
+
+public:
+  void span(int x0, int x1, int y, CellType cell_type);
+  void point(Coord p, CellType cell_type);
+  void line(Coord a, Coord b, CellType cell_type, int radius = 0);
+  void rect(Coord a, Coord b, CellType cell_type);
+  void circle(Coord center, int radius, CellType cell_type);
+  void flood_replace(Coord p, CellType cell_type);
+
+  bool empty();
+  Region bounds(Region world);
+  void clear();
+  void apply(CellGrid &grid);
+};
+
+#endif /* EDITS_H */
@@ -0,0 +1,133 @@
+
+#include "Ensemble.h"
+
+#include <sstream>
+#include <stdio.h>
+#include <string.h>
+
+#include "Diff.h"
+#include "Scene.h"
+#include "WorkerPool.h"
+
+using namespace std;
+
+Ensemble::Ensemble(int w, int h) : width(w), height(h), seed(0), engine(PLAIN_ENGINE), rules(STEP_RULES), ticks(0) {}
+
+void Ensemble::set_seed(Uint64 s) {
+  seed = s;
+}
+
+void Ensemble::set_engine(Engine e) {
+  engine = e;
+}
+
+void Ensemble::set_rules(Rules r) {
+  rules = r;
+}
+
+void Ensemble::add_scene(const char *path) {
+  Member member = {path, 0};
+  members.push_back(member);
+}
+
+void Ensemble::add_random(Uint64 scene_seed) {
+  Member member = {NULL, scene_seed};
+  members.push_back(member);
+}
+
+int Ensemble::size() {
+  return members.size();
+}
+
+void Ensemble::run(int max_ticks, int threads) {
+  ticks = max_ticks;
+  results.assign(members.size(), Result());
+  if (threads > 1) {
+    WorkerPool pool(threads);
+    pool.run(job, this, members.size());
+  }
+  else {
+    for (size_t i = 0; i < members.size(); i++) {
+      run_member(i);
+    }
+  }
+}
+
+void Ensemble::job(void *ensemble, int index) {
+  ((Ensemble *)ensemble)->run_member(index);
+}
+
+void Ensemble::run_member(int index) {
+  //Only touches its own world and its own result
+  const Member &member = members[index];
+  Result &result = results[index];
+  if (member.scene != NULL) {
+    result.name = member.scene;
+  }
+  else {
+    ostringstream name;
+    name << "random:" << member.scene_seed;
+    result.name = name.str();
+  }
+  result.ticks = 0;
+  result.settled_at = -1;
+  memset(result.cells, 0, sizeof(result.cells));
+  result.hash = 0;
+
+  SandGrid grid(width, height);
+  grid.set_seed(seed);
+  grid.set_engine(engine);
+  grid.set_rules(rules);
+  if (member.scene != NULL) {
+    result.loaded = load_scene(grid, member.scene);
+    if (!result.loaded) return;
+  }
+  else {
+    EditBatch batch;
+    random_scene(batch, width, height, member.scene_seed);
+    grid.apply(batch);
+    result.loaded = true;
+  }
+
+  while (grid.ticks() < ticks) {
+    grid.update(true);
+    if (grid.is_settled()) {
+      result.settled_at = grid.ticks();
+      break;
+    }
+  }
+  result.ticks = grid.ticks();
+  grid.current().count_cells(result.cells, CELL_TYPE_COUNT);
+  result.hash = hash_cells(grid.current());
+}
+
+const vector<Ensemble::Result> &Ensemble::get_results() {
+  return results;
+}
+
+void Ensemble::write(ostream &out) {
+  //One line per world, tab separated, in the order they were added
+  out << "#name\tticks\tsettled";
+  for (int c = FIRST_CELL_TYPE; c < CELL_TYPE_COUNT; c++) {
+    out << '\t';
+    for (const wchar_t *s = CellData::name((CellType)c); *s; s++) {
+      out << (*s == ' ' ? '_' : (char)*s);
+    }
+  }
+  out << "\thash" << endl;
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result &result = results[i];
+    out << result.name;
+    if (!result.loaded) {
+      out << "\tunreadable" << endl;
+      continue;
+    }
+    out << '\t' << result.ticks << '\t' << result.settled_at;
+    for (int c = FIRST_CELL_TYPE; c < CELL_TYPE_COUNT; c++) {
+      out << '\t' << result.cells[c];
+    }
+    char hash[20];
+    sprintf(hash, "%016llx", (unsigned long long)result.hash);
+    out << '\t' << hash << endl;
+  }
+}
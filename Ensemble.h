@@ -0,0 +1,61 @@
+
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Physics.h"
+
+/*
+Lots of small, separate worlds run in one go, for parameter sweeps: one
+process with a WorkerPool instead of a launch per scene. Each world is
+made, run and thrown away by one thread, so it comes out exactly as it
+would on its own; only the per-world results are kept.
+
+A world that settles stops being ticked. It wouldn't change any more,
+and the results say when it settled.
+*/
+class Ensemble {
+public:
+  struct Result {
+    std::string name;
+    bool loaded; //false if the scene couldn't be read
+    int ticks;
+    int settled_at; //-1 if it never settled
+    long long cells[CELL_TYPE_COUNT];
+    Uint64 hash; //see hash_cells
+  };
+
+private:
+  struct Member {
+    const char *scene; //NULL for a random scene
+    Uint64 scene_seed;
+  };
+
+  int width, height;
+  Uint64 seed;
+  Engine engine;
+  Rules rules;
+  int ticks;
+  std::vector<Member> members;
+  std::vector<Result> results;
+
+  static void job(void *ensemble, int index);
+  void run_member(int index);
+
+public:
+  Ensemble(int width, int height);
+  void set_seed(Uint64 seed);
+  void set_engine(Engine engine);
+  void set_rules(Rules rules);
+  void add_scene(const char *path);
+  void add_random(Uint64 scene_seed);
+  int size();
+  void run(int ticks, int threads);
+  const std::vector<Result> &get_results();
+  void write(std::ostream &out);
+};
+
+#endif /* ENSEMBLE_H */
@@ -0,0 +1,224 @@
+
+#include "Frames.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+#include <algorithm>
+#include <SDL/SDL_gfxPrimitives.h>
+
+#include "Viewport.h"
+
+using namespace std;
+
+const char *frame_format_names[FrameExporter::FORMAT_COUNT] = {"raw", "png"};
+
+static void put32(Uint8 *out, Uint32 v) {
+  //Big endian, like PNG wants
+  for (int i = 0; i < 4; i++) out[i] = v >> (24 - 8*i);
+}
+
+static bool write_chunk(FILE *f, const char *type, const Uint8 *data, Uint32 size) {
+  Uint8 head[8];
+  put32(head, size);
+  memcpy(head + 4, type, 4);
+  uLong crc = crc32(crc32(0L, Z_NULL, 0), head + 4, 4);
+  if (size) crc = crc32(crc, data, size);
+  Uint8 tail[4];
+  put32(tail, crc);
+  return fwrite(head, 1, 8, f) == 8 && fwrite(data, 1, size, f) == size && fwrite(tail, 1, 4, f) == 4;
+}
+
+static bool write_png(FILE *f, int width, int height, const Uint8 *rgb) {
+  //Truecolour, 8 bits a channel, no filtering; flat colours squash fine anyway
+  static const Uint8 signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+  Uint8 header[13];
+  put32(header, width);
+  put32(header + 4, height);
+  header[8] = 8; //bits
+  header[9] = 2; //RGB
+  header[10] = header[11] = header[12] = 0; //compression, filter, no interlace
+  if (fwrite(signature, 1, 8, f) != 8 || !write_chunk(f, "IHDR", header, 13)) {
+    return false;
+  }
+
+  int row_bytes = width*3;
+  vector<Uint8> rows((row_bytes + 1)*height);
+  for (int y = 0; y < height; y++) {
+    rows[y*(row_bytes + 1)] = 0; //filter type
+    memcpy(&rows[y*(row_bytes + 1) + 1], rgb + y*row_bytes, row_bytes);
+  }
+  uLongf size = compressBound(rows.size());
+  vector<Uint8> packed(size);
+  if (compress2(&packed[0], &size, &rows[0], rows.size(), Z_BEST_SPEED) != Z_OK) {
+    return false;
+  }
+  return write_chunk(f, "IDAT", &packed[0], size) && write_chunk(f, "IEND", NULL, 0);
+}
+
+FrameExporter::FrameExporter(const char *prefix, Format format, int scale, int thread_count, int max_queued)
+    : prefix(prefix), format(format), scale(scale), max_queued(max_queued), quitting(false),
+      added(0), written(0), dropped(0), failed(0) {
+  //There's no screen to take the colours from
+  SDL_Surface *like = SDL_CreateRGBSurface(SDL_SWSURFACE, 1, 1, 32, 0xFF0000, 0xFF00, 0xFF, 0);
+  if (like == NULL) {
+    sdl_error();
+  }
+  CellData::init_color(like);
+  SDL_FreeSurface(like);
+
+  lock = SDL_CreateMutex();
+  wake = SDL_CreateCond();
+  if (lock == NULL || wake == NULL) {
+    sdl_error();
+  }
+  for (int i = 0; i < std::max(thread_count, 1); i++) {
+    SDL_Thread *thread = SDL_CreateThread(worker, this);
+    if (thread == NULL) {
+      sdl_error();
+    }
+    threads.push_back(thread);
+  }
+}
+
+FrameExporter::~FrameExporter() {
+  finish();
+  SDL_DestroyCond(wake);
+  SDL_DestroyMutex(lock);
+  for (size_t i = 0; i < spare.size(); i++) {
+    delete spare[i];
+  }
+}
+
+void FrameExporter::add(SandGrid &grid) {
+  SDL_LockMutex(lock);
+  if (quitting || (int)queue.size() >= max_queued) {
+    dropped++;
+    SDL_UnlockMutex(lock);
+    return;
+  }
+  Job *job;
+  if (spare.empty()) {
+    job = new Job;
+  }
+  else {
+    job = spare.back();
+    spare.pop_back();
+  }
+  job->number = added++;
+  SDL_UnlockMutex(lock);
+
+  grid.snapshot(job->cells);
+
+  SDL_LockMutex(lock);
+  queue.push_back(job);
+  SDL_CondSignal(wake);
+  SDL_UnlockMutex(lock);
+}
+
+void FrameExporter::finish() {
+  //The workers empty the queue before they go
+  SDL_LockMutex(lock);
+  quitting = true;
+  SDL_CondBroadcast(wake);
+  SDL_UnlockMutex(lock);
+  for (size_t i = 0; i < threads.size(); i++) {
+    SDL_WaitThread(threads[i], NULL);
+  }
+  threads.clear();
+}
+
+int FrameExporter::worker(void *exporter) {
+  ((FrameExporter *)exporter)->work();
+  return 0;
+}
+
+void FrameExporter::work() {
+  SDL_Surface *frame = NULL;
+  GridRenderer renderer;
+  vector<Uint8> rgb;
+  SDL_LockMutex(lock);
+  while (true) {
+    while (!quitting && queue.empty()) {
+      SDL_CondWait(wake, lock);
+    }
+    if (queue.empty()) break;
+    Job *job = queue.front();
+    queue.pop_front();
+    SDL_UnlockMutex(lock);
+
+    if (frame == NULL) {
+      //Sized like the window would be for the whole world
+      frame = SDL_CreateRGBSurface(SDL_SWSURFACE,
+          job->cells.get_width()*scale + 2, job->cells.get_height()*scale + 2,
+          32, 0xFF0000, 0xFF00, 0xFF, 0);
+      if (frame == NULL) {
+        sdl_error();
+      }
+    }
+    bool ok = write(job, renderer, frame, rgb);
+    job->cells.clear(); //let go of the world's chunks
+
+    SDL_LockMutex(lock);
+    if (ok) written++;
+    else failed++;
+    spare.push_back(job);
+  }
+  SDL_UnlockMutex(lock);
+  SDL_FreeSurface(frame);
+}
+
+bool FrameExporter::write(Job *job, GridRenderer &renderer, SDL_Surface *frame, vector<Uint8> &rgb) {
+  Viewport view(frame->w - 2, frame->h - 2);
+  view.cell_pixels = scale;
+  SDL_FillRect(frame, NULL, CellData::color(AIR));
+  renderer.draw(frame, job->cells, view);
+  rectangleRGBA(frame, 0, 0, frame->w - 1, frame->h - 1, 0x80, 0x80, 0x80, 0xFF);
+
+  rgb.resize(frame->w*frame->h*3);
+  SDL_LockSurface(frame);
+  for (int y = 0; y < frame->h; y++) {
+    const Uint32 *row = (const Uint32 *)((const Uint8 *)frame->pixels + y*frame->pitch);
+    Uint8 *out = &rgb[y*frame->w*3];
+    for (int x = 0; x < frame->w; x++) {
+      //We picked the masks, so no need for SDL_GetRGB
+      *out++ = row[x] >> 16;
+      *out++ = row[x] >> 8;
+      *out++ = row[x];
+    }
+  }
+  SDL_UnlockSurface(frame);
+
+  char number[16];
+  sprintf(number, "%06d", job->number);
+  string path = prefix + number + (format == PNG ? ".png" : ".rgb");
+  FILE *f = fopen(path.c_str(), "wb");
+  if (f == NULL) {
+    perror(path.c_str());
+    return false;
+  }
+  bool ok;
+  if (format == PNG) {
+    ok = write_png(f, frame->w, frame->h, &rgb[0]);
+  }
+  else {
+    ok = fwrite(&rgb[0], 1, rgb.size(), f) == rgb.size();
+  }
+  if (fclose(f) || !ok) {
+    cerr << "Couldn't write " << path << endl;
+    return false;
+  }
+  return true;
+}
+
+int FrameExporter::frames_written() {
+  return written;
+}
+
+int FrameExporter::frames_dropped() {
+  return dropped;
+}
+
+int FrameExporter::frames_failed() {
+  return failed;
+}
@@ -0,0 +1,66 @@
+
+#ifndef FRAMES_H
+#define FRAMES_H
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <SDL/SDL.h>
+#include <SDL/SDL_thread.h>
+
+#include "Physics.h"
+
+/*
+Pictures of the world for recordings, drawn without a window. add() takes
+a copy-on-write copy of the world (see SandGrid::snapshot) and returns;
+a few threads of our own, each with its own GridRenderer, draw the copies,
+water and all, into memory and write them out as PREFIX000000.png,
+PREFIX000001.png... or as raw 24 bit RGB (PREFIX000000.rgb), which is
+quicker to write and bigger.
+
+The world never waits for a picture. If the threads fall too far behind,
+frames get dropped instead, and counted.
+*/
+class FrameExporter {
+public:
+  enum Format { RAW, PNG, FORMAT_COUNT };
+
+private:
+  struct Job {
+    CellGrid cells;
+    int number;
+    Job() : cells(0, 0), number(0) {}
+  };
+
+  std::string prefix;
+  Format format;
+  int scale; //pixels across a cell
+  int max_queued;
+  std::vector<SDL_Thread *> threads;
+  SDL_mutex *lock;
+  SDL_cond *wake;
+  std::deque<Job *> queue;
+  std::vector<Job *> spare;
+  bool quitting;
+  int added, written, dropped, failed;
+
+  FrameExporter(const FrameExporter &);
+  static int worker(void *exporter);
+  void work();
+  bool write(Job *job, GridRenderer &renderer, SDL_Surface *frame, std::vector<Uint8> &rgb);
+
+public:
+  FrameExporter(const char *prefix, Format format, int scale, int thread_count, int max_queued = 256);
+  ~FrameExporter();
+  void add(SandGrid &grid);
+  //Waits for everything that was added; no more add()s after this
+  void finish();
+  int frames_written();
+  int frames_dropped();
+  int frames_failed();
+};
+
+extern const char *frame_format_names[FrameExporter::FORMAT_COUNT];
+
+#endif /* FRAMES_H */
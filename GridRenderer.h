@@ -0,0 +1,28 @@
+
+#ifndef GRIDRENDERER_H
+#define GRIDRENDERER_H
+
+#include <SDL/SDL.h>
+
+#include "CellGrid.h"
+#include "Viewport.h"
+
+/*
+Draws a CellGrid cell by cell, with the fancy water. Holds the scratch
+surface the water gets drawn on, so give every thread its own.
+*/
+class GridRenderer {
+private:
+  SDL_Surface *water_surface; //made the first time it's needed
+
+  GridRenderer(const GridRenderer &);
+  GridRenderer &operator=(const GridRenderer &);
+  void draw_active_water(const CellGrid &cells, Coord here, SDL_Surface *water);
+
+public:
+  GridRenderer();
+  ~GridRenderer();
+  void draw(SDL_Surface *surface, const CellGrid &cells, const Viewport &view);
+};
+
+#endif /* GRIDRENDERER_H */
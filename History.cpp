@@ -0,0 +1,98 @@
+
+#include "History.h"
+
+using namespace std;
+
+TickHistory::TickHistory(int max_ticks, size_t max_bytes) : newest(0, 0), newest_odd(false), max_ticks(max_ticks), max_bytes(max_bytes), kept_bytes(0) {}
+
+void TickHistory::set_limits(int ticks, size_t bytes) {
+  max_ticks = ticks;
+  max_bytes = bytes;
+  while (!older.empty() && ((int)older.size() > max_ticks || kept_bytes > max_bytes)) {
+    drop_oldest();
+  }
+}
+
+void TickHistory::restart(CellGrid &cells, bool odd) {
+  //Forget everything and start again from 'cells'
+  older.clear();
+  kept_bytes = 0;
+  cells.freeze(newest);
+  newest_odd = odd;
+  pending.resize(cells.chunk_count());
+}
+
+void TickHistory::note(const ChunkSet &changed) {
+  //Chunks changed by something that isn't a tick, for the next record
+  if (pending.size() == changed.size()) {
+    pending.add(changed);
+  }
+}
+
+void TickHistory::record(CellGrid &cells, const ChunkSet &changed, bool odd) {
+  //Called after every tick with the world's current cells and the chunks
+  //the tick might have changed
+  if (newest.get_width() != cells.get_width() || newest.get_height() != cells.get_height()) {
+    restart(cells, odd);
+    return;
+  }
+  pending.add(changed);
+  look_at = pending.list();
+  pending.clear();
+  older.push_back(Tick()); //filled in place, copying chunks copies their bytes
+  Tick &tick = older.back();
+  tick.ticks = newest.ticks;
+  tick.odd = newest_odd;
+  cells.freeze_changes(newest, look_at, tick.changed, tick.was);
+  newest_odd = odd;
+  tick.bytes = sizeof(Tick) + tick.changed.size()*(sizeof(int) + sizeof(Chunk));
+  for (size_t i = 0; i < tick.was.size(); i++) {
+    tick.bytes += tick.was[i].data_bytes();
+  }
+  kept_bytes += tick.bytes;
+  set_limits(max_ticks, max_bytes);
+}
+
+void TickHistory::drop_oldest() {
+  kept_bytes -= older.front().bytes;
+  older.pop_front();
+}
+
+bool TickHistory::rewind(int tick, CellGrid &cells, bool &odd) {
+  //Back to the last kept tick no later than 'tick', or the oldest there is,
+  //which goes into 'cells'. Everything after it is forgotten. False if
+  //there's nothing to go back to.
+  if (newest.get_width() == 0 || (older.empty() && newest.ticks > tick)) return false;
+  while (!older.empty() && newest.ticks > tick) {
+    Tick &back = older.back();
+    newest.put_back(back.changed, back.was);
+    newest.ticks = back.ticks;
+    newest_odd = back.odd;
+    kept_bytes -= back.bytes;
+    older.pop_back();
+  }
+  newest.freeze(cells);
+  odd = newest_odd;
+  pending.clear();
+  return true;
+}
+
+void TickHistory::share(CellGrid &cells) {
+  //'cells' has just been set to the newest tick, but as a copy; share
+  //its chunks again so the next record only keeps what changes from here
+  cells.freeze(newest);
+}
+
+int TickHistory::oldest_tick() const {
+  return older.empty() ? newest.ticks : older.front().ticks;
+}
+
+int TickHistory::ticks_kept() const {
+  return older.size();
+}
+
+size_t TickHistory::bytes() const {
+  //About how much the older ticks take; the newest is mostly shared with
+  //the world
+  return kept_bytes;
+}
@@ -0,0 +1,55 @@
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <deque>
+#include <vector>
+
+#include "CellGrid.h"
+
+/*
+The last so many ticks of a world, to rewind to. The newest tick is a
+frozen copy of the world (see CellGrid::freeze), sharing every chunk it
+hasn't written since. Each older tick only keeps the chunks the tick after
+it changed, as they were, so a tick where little moved costs little; going
+back is swapping those in, newest first. Only the chunks the world says
+it might have changed get looked at (see SandGrid::changed_chunks), edits
+while paused (note()) included.
+
+Falling speeds aren't kept, so after a rewind everything starts off still.
+*/
+class TickHistory {
+private:
+  struct Tick {
+    int ticks;
+    bool odd; //parity, see SandGrid::snapshot
+    std::vector<int> changed; //chunk indices
+    std::vector<Chunk> was; //what the tick after changed them from
+    size_t bytes;
+  };
+  std::deque<Tick> older; //oldest first
+  CellGrid newest;
+  bool newest_odd;
+  ChunkSet pending; //changed since the newest tick
+  std::vector<int> look_at;
+  int max_ticks;
+  size_t max_bytes, kept_bytes;
+
+  TickHistory(const TickHistory &);
+  void drop_oldest();
+
+public:
+  TickHistory(int max_ticks = 0, size_t max_bytes = 0);
+  void set_limits(int max_ticks, size_t max_bytes);
+  void restart(CellGrid &cells, bool odd);
+  void note(const ChunkSet &changed);
+  void record(CellGrid &cells, const ChunkSet &changed, bool odd);
+  bool rewind(int tick, CellGrid &cells, bool &odd);
+  void share(CellGrid &cells);
+
+  int oldest_tick() const;
+  int ticks_kept() const;
+  size_t bytes() const;
+};
+
+#endif /* HISTORY_H */
@@ -0,0 +1,218 @@
+
+#include "Journal.h"
+
+#include <algorithm>
+#include <iostream>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+using namespace std;
+
+const char delta_magic[8] = {'S', 'A', 'N', 'D', 'D', 'L', 'T', 'A'};
+const Uint32 delta_version = 1;
+const int change_size = 6;
+
+static void put32(Uint8 *out, Uint32 v) {
+  for (int i = 0; i < 4; i++) out[i] = v >> (8*i);
+}
+
+static Uint32 get32(const Uint8 *in) {
+  return in[0] | (in[1] << 8) | (in[2] << 16) | ((Uint32)in[3] << 24);
+}
+
+DeltaJournal::DeltaJournal() : seen(0, 0), everything(true) {}
+
+void DeltaJournal::subscribe(Subscriber callback, void *user) {
+  Subscription subscription = {callback, user};
+  subscribers.push_back(subscription);
+}
+
+void DeltaJournal::unsubscribe(Subscriber callback, void *user) {
+  for (size_t i = 0; i < subscribers.size(); i++) {
+    if (subscribers[i].callback == callback && subscribers[i].user == user) {
+      subscribers.erase(subscribers.begin() + i);
+      return;
+    }
+  }
+}
+
+void DeltaJournal::record(const CellGrid &cells, const ChunkSet &changed) {
+  //'changed' has every chunk that might be different since the last
+  //record; the first time round that's all of them
+  order.clear();
+  if (seen.get_width() != cells.get_width() || seen.get_height() != cells.get_height()) {
+    seen = CellGrid(cells.get_width(), cells.get_height()); //all air
+    everything = true;
+  }
+  if (everything) {
+    for (int i = 0; i < seen.chunk_count(); i++) {
+      order.push_back(i);
+    }
+    everything = false;
+  }
+  else {
+    order = changed.list();
+    sort(order.begin(), order.end()); //the same list whatever wrote them
+  }
+  changes.clear();
+  for (size_t i = 0; i < order.size(); i++) {
+    cells.changes_since(seen, order[i], changes);
+    seen.copy_region(cells, cells.chunk_region(order[i]));
+  }
+  seen.forget_written();
+  seen.ticks = cells.ticks;
+  for (size_t i = 0; i < subscribers.size(); i++) {
+    subscribers[i].callback(cells.ticks, changes.empty() ? NULL : &changes[0], changes.size(), subscribers[i].user);
+  }
+}
+
+void DeltaJournal::resync() {
+  //The next record looks at everything, for when we've missed some ticks
+  everything = true;
+}
+
+const vector<CellChange> &DeltaJournal::last() {
+  return changes;
+}
+
+int DeltaJournal::so_far(vector<CellChange> &out) {
+  out.clear();
+  seen.changes_since(CellGrid(seen.get_width(), seen.get_height()), out);
+  return seen.ticks;
+}
+
+DeltaStream::DeltaStream() : file(NULL), width(0), journal(NULL) {}
+
+DeltaStream::~DeltaStream() {
+  close();
+}
+
+bool DeltaStream::open(const char *path, int w, int h, DeltaJournal &changes) {
+  close();
+  file = fopen(path, "wb");
+  if (file == NULL) {
+    perror(path);
+    return false;
+  }
+  width = w;
+  Uint8 header[8 + 3*4];
+  memcpy(header, delta_magic, 8);
+  put32(header + 8, delta_version);
+  put32(header + 12, w);
+  put32(header + 16, h);
+  fwrite(header, 1, sizeof(header), file);
+  //Starting late, so the reader needs to catch up first
+  vector<CellChange> start;
+  int tick = changes.so_far(start);
+  if (!start.empty()) {
+    write(tick, &start[0], start.size(), this);
+  }
+  journal = &changes;
+  journal->subscribe(write, this);
+  return true;
+}
+
+void DeltaStream::close() {
+  if (journal != NULL) {
+    journal->unsubscribe(write, this);
+    journal = NULL;
+  }
+  if (file != NULL) {
+    fclose(file);
+    file = NULL;
+  }
+}
+
+void DeltaStream::fail() {
+  //Nobody's reading any more; carry on without them
+  perror("Writing changes");
+  fclose(file);
+  file = NULL;
+}
+
+void DeltaStream::write(int tick, const CellChange *changes, int count, void *stream) {
+  //A tick is built up whole and handed to stdio in one go, but stdio and
+  //the pipe can still pass it on in pieces, and a failed write can cut it
+  //short. Nothing is written after that (fail() closes the stream), so the
+  //reader sees whole ticks and then, at worst, part of one before the end.
+  DeltaStream *self = (DeltaStream *)stream;
+  if (self->file == NULL) return;
+  self->buffer.resize(8 + count*change_size);
+  Uint8 *out = &self->buffer[0];
+  put32(out, tick);
+  put32(out + 4, count);
+  out += 8;
+  for (int i = 0; i < count; i++, out += change_size) {
+    put32(out, changes[i].y*self->width + changes[i].x);
+    out[4] = changes[i].was;
+    out[5] = changes[i].is;
+  }
+  //A viewer on the other end of a pipe can close it whenever it likes;
+  //that's a failed write, not a reason to die. So SIGPIPE waits while we
+  //write, and if we caused one it's taken back out before it's let go.
+  sigset_t pipe, pending, old;
+  sigemptyset(&pipe);
+  sigaddset(&pipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &pipe, &old);
+  sigpending(&pending);
+  bool already = sigismember(&pending, SIGPIPE);
+  bool ok = fwrite(&self->buffer[0], 1, self->buffer.size(), self->file) == self->buffer.size()
+    && !fflush(self->file);
+  if (!ok && !already) {
+    timespec now = {0, 0};
+    sigtimedwait(&pipe, NULL, &now);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (!ok) {
+    self->fail();
+  }
+}
+
+DeltaReader::DeltaReader() : file(NULL) {}
+
+DeltaReader::~DeltaReader() {
+  if (file != NULL) {
+    fclose(file);
+  }
+}
+
+bool DeltaReader::open(const char *path, int &width, int &height) {
+  file = fopen(path, "rb");
+  if (file == NULL) {
+    perror(path);
+    return false;
+  }
+  Uint8 header[8 + 3*4];
+  if (fread(header, 1, sizeof(header), file) != sizeof(header)
+      || memcmp(header, delta_magic, 8) || get32(header + 8) != delta_version) {
+    cerr << path << " isn't a stream of changes" << endl;
+    return false;
+  }
+  width = get32(header + 12);
+  height = get32(header + 16);
+  return true;
+}
+
+bool DeltaReader::next(CellGrid &cells, int &tick, int &count) {
+  //A tick is only applied once all of it has been read; a writer that
+  //died halfway through one leaves a piece that just ends the stream
+  Uint8 head[8];
+  if (fread(head, 1, 8, file) != 8) return false;
+  tick = get32(head);
+  Uint32 changes = get32(head + 4);
+  int width = cells.get_width();
+  if (changes > (Uint32)(width*cells.get_height())) return false;
+  count = changes;
+  buffer.resize(count*change_size);
+  if (count > 0 && fread(&buffer[0], 1, buffer.size(), file) != buffer.size()) return false;
+  for (int i = 0; i < count; i++) {
+    const Uint8 *change = &buffer[i*change_size];
+    Uint32 index = get32(change);
+    CellType c = change[5] < CELL_TYPE_COUNT ? (CellType)change[5] : ROCK;
+    cells.set(index % width, index / width, c);
+  }
+  cells.ticks = tick;
+  return true;
+}
@@ -0,0 +1,94 @@
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <vector>
+
+#include "CellGrid.h"
+
+/*
+What changed each tick, for whatever wants to follow the world without
+diffing it: each subscriber gets the list of cells that changed, with what
+they were and are. The journal keeps its own copy of the cells as of the
+last record, and is told which chunks might have changed since (see
+SandGrid::changed_chunks), so working out the list only looks at those.
+Edits between ticks turn up in the next tick's list.
+
+The first list a journal hands out is everything that isn't air.
+*/
+class DeltaJournal {
+public:
+  typedef void (*Subscriber)(int tick, const CellChange *changes, int count, void *user);
+
+private:
+  struct Subscription {
+    Subscriber callback;
+    void *user;
+  };
+  std::vector<Subscription> subscribers;
+  CellGrid seen;
+  std::vector<CellChange> changes;
+  std::vector<int> order; //the chunks to look at, in order
+  bool everything; //look at every chunk next time
+
+  DeltaJournal(const DeltaJournal &);
+
+public:
+  DeltaJournal();
+  void subscribe(Subscriber callback, void *user);
+  void unsubscribe(Subscriber callback, void *user);
+  void record(const CellGrid &cells, const ChunkSet &changed);
+  void resync();
+  const std::vector<CellChange> &last();
+  //Where the world was at the last record, as changes from all air; for
+  //subscribers that turn up late. Empty before the first record.
+  int so_far(std::vector<CellChange> &out);
+};
+
+/*
+A journal written out for another process, e.g. down a FIFO to sand
+--watch: "SANDDLTA", little endian 32 bit version, width and height, then
+for every tick its number and how many changes, and each change as a 32
+bit cell index (y*width + x) and the old and new cell type.
+
+A tick can reach the reader in pieces, but never mixed with another. If
+the reader goes away writes just fail and the stream is closed, so the
+most it gets is whole ticks and then part of one, which DeltaReader
+takes as the end. SIGPIPE is held off while this thread writes, so
+nothing else in the program has to ignore it.
+*/
+class DeltaStream {
+private:
+  FILE *file;
+  int width;
+  DeltaJournal *journal;
+  std::vector<Uint8> buffer;
+
+  DeltaStream(const DeltaStream &);
+  static void write(int tick, const CellChange *changes, int count, void *stream);
+  void fail();
+
+public:
+  DeltaStream();
+  ~DeltaStream();
+  bool open(const char *path, int width, int height, DeltaJournal &journal);
+  void close();
+};
+
+//Reads a DeltaStream back, a tick at a time
+class DeltaReader {
+private:
+  FILE *file;
+  std::vector<Uint8> buffer;
+
+public:
+  DeltaReader();
+  ~DeltaReader();
+  bool open(const char *path, int &width, int &height);
+  //Applies the next tick's changes to 'cells'; false at the end, or if
+  //the stream stops partway through a tick (which is left unapplied)
+  bool next(CellGrid &cells, int &tick, int &count);
+};
+
+#endif /* JOURNAL_H */
@@ -0,0 +1,109 @@
+
+#include "Overview.h"
+
+Overview::Overview() : width(0), height(0), chunks_across(0) {}
+
+void Overview::resize(int w, int h) {
+  width = w;
+  height = h;
+  levels.clear();
+  for (int k = 1; k <= max_lod; k++) {
+    Level level;
+    level.width = (w + (1 << k) - 1) >> k;
+    level.height = (h + (1 << k) - 1) >> k;
+    level.texels.resize(level.width*level.height);
+    levels.push_back(level);
+  }
+  chunks_across = (w + chunk_size-1) >> chunk_shift;
+  dirty.resize(chunks_across*((h + chunk_size-1) >> chunk_shift));
+  dirty.add_all();
+}
+
+void Overview::touch(Region r) {
+  //Before the first draw everything's going to be done anyway
+  r = r.clip(Region(0, 0, width-1, height-1));
+  if (r.empty()) return;
+  for (int cy = r.y0 >> chunk_shift; cy <= r.y1 >> chunk_shift; cy++) {
+    for (int cx = r.x0 >> chunk_shift; cx <= r.x1 >> chunk_shift; cx++) {
+      dirty.add(cy*chunks_across + cx);
+    }
+  }
+}
+
+void Overview::touch(const ChunkSet &chunks) {
+  if (chunks.size() == dirty.size()) {
+    dirty.add(chunks);
+  }
+}
+
+void Overview::rebuild(const CellGrid &cells, Region r) {
+  //Round out to whole chunks, then work up a level at a time; each level
+  //only needs the texels under the ones above it.
+  r = Region(r.x0 & ~(chunk_size-1), r.y0 & ~(chunk_size-1),
+      r.x1 | (chunk_size-1), r.y1 | (chunk_size-1));
+  for (int k = 0; k < (int)levels.size(); k++) {
+    Level &level = levels[k];
+    r = Region(r.x0 >> 1, r.y0 >> 1, r.x1 >> 1, r.y1 >> 1).clip(Region(0, 0, level.width-1, level.height-1));
+    for (int ty = r.y0; ty <= r.y1; ty++) {
+      for (int tx = r.x0; tx <= r.x1; tx++) {
+        int sum_r = 0, sum_g = 0, sum_b = 0, count = 0;
+        for (int y = ty*2; y <= ty*2+1; y++) {
+          for (int x = tx*2; x <= tx*2+1; x++) {
+            if (k == 0) {
+              if (x >= width || y >= height) continue;
+              SDL_Color c = CellData::rgb(cells.get(x, y));
+              sum_r += c.r;
+              sum_g += c.g;
+              sum_b += c.b;
+            }
+            else {
+              const Level &below = levels[k-1];
+              if (x >= below.width || y >= below.height) continue;
+              const Texel &t = below.texels[y*below.width + x];
+              sum_r += t.r;
+              sum_g += t.g;
+              sum_b += t.b;
+            }
+            count++;
+          }
+        }
+        Texel &t = level.texels[ty*level.width + tx];
+        t.r = sum_r/count;
+        t.g = sum_g/count;
+        t.b = sum_b/count;
+      }
+    }
+  }
+}
+
+void Overview::draw(SDL_Surface *surface, const CellGrid &cells, const Viewport &view) {
+  if (width != cells.get_width() || height != cells.get_height()) {
+    resize(cells.get_width(), cells.get_height());
+  }
+  //Each chunk redoes every level over it, so a texel over several dirty
+  //chunks comes out right once the last of them is done
+  const std::vector<int> &redo = dirty.list();
+  for (size_t i = 0; i < redo.size(); i++) {
+    rebuild(cells, cells.chunk_region(redo[i]));
+  }
+  dirty.clear();
+
+  //One texel per pixel
+  const Level &level = levels[view.lod-1];
+  if (SDL_MUSTLOCK(surface)) {
+    SDL_LockSurface(surface);
+  }
+  for (int py = 0; py < view.screen_h; py++) {
+    int ty = (view.y >> view.lod) + py;
+    if (ty < 0 || ty >= level.height) continue;
+    for (int px = 0; px < view.screen_w; px++) {
+      int tx = (view.x >> view.lod) + px;
+      if (tx < 0 || tx >= level.width) continue;
+      const Texel &t = level.texels[ty*level.width + tx];
+      putpixel(surface, px+1, py+1, SDL_MapRGB(surface->format, t.r, t.g, t.b));
+    }
+  }
+  if (SDL_MUSTLOCK(surface)) {
+    SDL_UnlockSurface(surface);
+  }
+}
@@ -0,0 +1,39 @@
+
+#ifndef OVERVIEW_H
+#define OVERVIEW_H
+
+#include <vector>
+
+#include "CellGrid.h"
+#include "Viewport.h"
+
+/*
+Averaged colours of the world at 1/2, 1/4, 1/8... scale, for drawing when
+zoomed out past a pixel per cell. Only the chunks that were touched since
+the last draw get redone, so keeping it current costs about as much as the
+cells that changed.
+*/
+class Overview {
+private:
+  struct Texel {
+    Uint8 r, g, b;
+  };
+  struct Level {
+    int width, height;
+    std::vector<Texel> texels;
+  };
+  std::vector<Level> levels; //levels[k] is 2^(k+1) cells across per texel
+  int width, height, chunks_across;
+  ChunkSet dirty; //same numbering as CellGrid's chunks
+
+  void resize(int w, int h);
+  void rebuild(const CellGrid &cells, Region r);
+
+public:
+  Overview();
+  void touch(Region r);
+  void touch(const ChunkSet &chunks);
+  void draw(SDL_Surface *surface, const CellGrid &cells, const Viewport &view);
+};
+
+#endif /* OVERVIEW_H */
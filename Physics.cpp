@@ -1,8 +1,14 @@
 #include "Physics.h"
 #include <iostream>
+#include <string.h>
+
+CellType FluidSimulator::look(int x, int y) {
+  //Anything outside the bounds is treated like the edge of the world
+  return bounds.contains(x, y) ? src.get(x, y) : AIR;
+}
 
 void FluidSimulator::add(int x, int y) {
-  if (src.get(x, y, AIR) == EXPOSED_WATER) {
+  if (look(x, y) == EXPOSED_WATER) {
     exposed.push_back(Coord(x, y));
     src.set(x, y, AIR);
   }
@@ -32,29 +38,29 @@ void FluidSimulator::flood_fill(int x, int y) {
   while (branch.size()) {
     pop(x, y);
     //jump to end
-    while (src.get(x, y, AIR) == INACTIVE_WATER) y--;
+    while (look(x, y) == INACTIVE_WATER) y--;
     add(x, y);
     y++;
 
     bool span_left = false, span_right = false;
-    while (y < grid_size && src.get(x, y, AIR) == INACTIVE_WATER) {
+    while (y <= bounds.y1 && look(x, y) == INACTIVE_WATER) {
       src.set(x, y, ROCK);
       add(x-1, y);
       add(x+1, y);
 
-      if (!span_left && src.get(x-1, y, AIR) == INACTIVE_WATER) {
+      if (!span_left && look(x-1, y) == INACTIVE_WATER) {
         push(x-1, y);
         span_left = true;
       }
-      else if (span_left && src.get(x-1, y, AIR) != INACTIVE_WATER) {
+      else if (span_left && look(x-1, y) != INACTIVE_WATER) {
         span_left = false;
       }
 
-      if (!span_right && src.get(x+1, y, AIR) == INACTIVE_WATER) {
+      if (!span_right && look(x+1, y) == INACTIVE_WATER) {
         push(x+1, y);
         span_right = true;
       }
-      else if (span_right && src.get(x+1, y, AIR) != INACTIVE_WATER) {
+      else if (span_right && look(x+1, y) != INACTIVE_WATER) {
         span_right = false;
       }
 
@@ -65,24 +71,13 @@ void FluidSimulator::flood_fill(int x, int y) {
 }
 
 
-bool FluidSimulator::height_sorter(Coord a, Coord b) {
-  static char parity = 0;
-  if (a.y == b.y) {
-    parity++;
-    return (parity % 2) ? a.x < b.y : a.x > b.y;
-  }
-  return a.y < b.y;
-}
-
-
-void FluidSimulator::move_water(CellGrid &grid, Coord move, Coord target) {
+bool FluidSimulator::move_water(WaterView &grid, Coord move, Coord target) {
   //Try to move water to target
   //Check that it isn't a lame movement
-  if (move.y + 1 >= target.y) return; 
-  //We need to be considerate of the order we check.
-  static char parity = 0;
-  parity++; //XXX should check if this actually does anything
-  bool EVEN = parity % 2, ODD = !EVEN;
+  if (move.y + 1 >= target.y) return false;
+  //We need to be considerate of the order we check: a coin for the cell
+  //and tick decides which side gets tried first
+  bool EVEN = random.coin(tick, target.x, target.y), ODD = !EVEN;
   if (grid.get(target.down(), ROCK) == AIR) {
     //(I don't expect this will happen ever?)
     grid.set(target.down(), EXPOSED_WATER);
@@ -93,45 +88,216 @@ void FluidSimulator::move_water(CellGrid &grid, Coord move, Coord target) {
   else if (EVEN && grid.get(target.right(), ROCK) == AIR) {
     grid.set(target.right(), EXPOSED_WATER);
   }
-  else if (ODD && grid.get(target.left(), ROCK) == AIR) {
-    grid.set(target.left(), EXPOSED_WATER);
-  }
   else if (ODD && grid.get(target.right(), ROCK) == AIR) {
     grid.set(target.right(), EXPOSED_WATER);
   }
+  else if (ODD && grid.get(target.left(), ROCK) == AIR) {
+    grid.set(target.left(), EXPOSED_WATER);
+  }
   else if (grid.get(target.up(), ROCK) == AIR) {
     grid.set(target.up(), EXPOSED_WATER);
   }
   else {
-    return; //Didn't work
+    return false; //Didn't work
   }
   grid.set(move, AIR); //Did work
+  return true;
 }
 
 
-void FluidSimulator::run(CellGrid &orig_grid) {
-  src = orig_grid; //Make a copy
-  for (int x = 0; x < grid_size; x++) {
-    for (int y = 0; y < grid_size; y++) {
-      if (src.get(x, y) == EXPOSED_WATER) {
-        exposed.clear();
-        flood_fill(x, y);
-        sort(exposed.begin(), exposed.end()); //Higher water is at the front.
-        unique(exposed.begin(), exposed.end());
-        
-        /*
-        Now we move some water.
-        Exposed water at the top of the list is moved next to the exposed water
-        at the bottom of the list.
-        */
-        while (exposed.size() > 2) {
-          move_water(orig_grid, exposed.front(), exposed.back());
-          exposed.pop_front();
-          exposed.pop_back();
-        }
+FluidSimulator::WaterView::WaterView(CellGrid *g, bool defer) : grid(g), deferred(defer) {}
+
+void FluidSimulator::WaterView::reset(CellGrid *g, bool defer) {
+  grid = g;
+  deferred = defer;
+  reads.clear();
+  writes.clear();
+}
+
+CellType FluidSimulator::WaterView::get(Coord p, CellType default_type) {
+  if (deferred) {
+    reads.push_back(p);
+    //Our own writes win
+    std::map<Coord, CellType>::const_iterator mine = writes.find(p);
+    if (mine != writes.end()) {
+      return mine->second;
+    }
+  }
+  return grid->get(p, default_type);
+}
+
+void FluidSimulator::WaterView::set(Coord p, CellType c) {
+  if (deferred) {
+    writes[p] = c;
+  }
+  else {
+    grid->set(p, c);
+  }
+}
+
+
+int FluidSimulator::solve(WaterBody &body, WaterView &view) {
+  //Exposed water at the top of the list is moved next to the exposed water
+  //at the bottom of the list.
+  int moved = 0;
+  for (int i = 0, j = (int)body.exposed.size() - 1; j - i + 1 > 2; i++, j--) {
+    moved += move_water(view, body.exposed[i], body.exposed[j]);
+  }
+  return moved;
+}
+
+void FluidSimulator::prepare_job(void *sim, int index) {
+  FluidSimulator *self = (FluidSimulator *)sim;
+  WaterBody &body = self->bodies[index];
+  sort(body.exposed.begin(), body.exposed.end()); //Higher water is at the front.
+  unique(body.exposed.begin(), body.exposed.end());
+}
+
+void FluidSimulator::solve_job(void *sim, int index) {
+  FluidSimulator *self = (FluidSimulator *)sim;
+  WaterBody &body = self->bodies[index];
+  body.view.reset(self->target, true);
+  body.moved = self->solve(body, body.view);
+}
+
+bool FluidSimulator::written_this_run(Coord p) {
+  return p.x >= 0 && p.y >= 0 && p.x < target->get_width() && p.y < target->get_height()
+    && written[p.y*target->get_width() + p.x] == run_count;
+}
+
+bool FluidSimulator::clashes(const WaterView &view) {
+  //Did an earlier body touch anything this one looked at?
+  for (size_t i = 0; i < view.reads.size(); i++) {
+    if (written_this_run(view.reads[i])) return true;
+  }
+  std::map<Coord, CellType>::const_iterator i;
+  for (i = view.writes.begin(); i != view.writes.end(); i++) {
+    if (written_this_run(i->first)) return true;
+  }
+  return false;
+}
+
+void FluidSimulator::commit(const WaterView &view) {
+  std::map<Coord, CellType>::const_iterator i;
+  for (i = view.writes.begin(); i != view.writes.end(); i++) {
+    const Coord &p = i->first;
+    target->set(p, i->second);
+    if (p.x >= 0 && p.y >= 0 && p.x < target->get_width() && p.y < target->get_height()) {
+      written[p.y*target->get_width() + p.x] = run_count;
+    }
+  }
+}
+
+
+FluidSimulator::FluidSimulator() : bounds(0, 0, -1, -1), tick(0), pool(NULL), target(NULL), run_count(0), body_count(0) {}
+
+void FluidSimulator::set_pool(WorkerPool *workers) {
+  pool = workers;
+}
+
+int FluidSimulator::bodies_found() {
+  return body_count;
+}
+
+void FluidSimulator::start(CellGrid &orig_grid, Region region, const Random &rng) {
+  bounds = region;
+  random = rng;
+  tick = orig_grid.ticks;
+  target = &orig_grid;
+  if (src.get_width() != orig_grid.get_width() || src.get_height() != orig_grid.get_height()) {
+    src = orig_grid;
+  }
+  body_count = 0;
+}
+
+void FluidSimulator::find(int x, int y) {
+  //A new body, if (x, y) is exposed water that no body has taken yet
+  if (src.get(x, y) == EXPOSED_WATER) {
+    exposed.clear();
+    flood_fill(x, y);
+    if (body_count == (int)bodies.size()) {
+      bodies.push_back(WaterBody());
+    }
+    bodies[body_count++].exposed.swap(exposed);
+  }
+}
+
+int FluidSimulator::run(CellGrid &orig_grid, Region region, const Random &rng) {
+  //Returns how many water cells got moved
+  start(orig_grid, region, rng);
+  src.copy_region(orig_grid, bounds); //Make a copy
+
+  //Find every body of water up front, in scan order
+  for (int x = bounds.x0; x <= bounds.x1; x++) {
+    for (int y = bounds.y0; y <= bounds.y1; y++) {
+      find(x, y);
+    }
+  }
+  return move_bodies();
+}
+
+void FluidSimulator::find_bodies(CellGrid &orig_grid, Region region, const Random &rng, const std::vector<Coord> &starts, const std::vector<int> *chunks) {
+  //The first half of run(), for just the bodies found from 'starts', which
+  //are in scan order (a column at a time). With 'chunks' only those are
+  //copied to look at, so those bodies and the cells next to them have to be
+  //inside them. move_bodies() does the rest, and 'orig_grid' can change in
+  //between as long as it's nowhere near them.
+  start(orig_grid, region, rng);
+  if (chunks == NULL) {
+    src.copy_region(orig_grid, bounds);
+  }
+  for (size_t i = 0; chunks != NULL && i < chunks->size(); i++) {
+    src.copy_region(orig_grid, orig_grid.chunk_region((*chunks)[i]).clip(bounds));
+  }
+  for (size_t i = 0; i < starts.size(); i++) {
+    if (bounds.contains(starts[i].x, starts[i].y)) {
+      find(starts[i].x, starts[i].y);
+    }
+  }
+}
+
+int FluidSimulator::move_bodies() {
+  //Solves the bodies found since start(); returns how many cells moved
+  if (pool != NULL) {
+    pool->run(prepare_job, this, body_count);
+  }
+  else {
+    for (int i = 0; i < body_count; i++) {
+      prepare_job(this, i);
+    }
+  }
+
+  /*
+  Now we move some water.
+  With a pool every body is solved against the grid as it was before any
+  water moved, keeping its writes to itself. Then they're committed in scan
+  order. A body that read or wrote a cell an earlier body already wrote
+  gets solved again for real, so it ends up exactly like the serial order.
+  */
+  int moved = 0;
+  if (pool != NULL) {
+    pool->run(solve_job, this, body_count);
+    if (written.size() != target->get_width()*(size_t)target->get_height()) {
+      written.assign(target->get_width()*(size_t)target->get_height(), 0);
+      run_count = 0;
+    }
+    run_count++;
+  }
+  for (int i = 0; i < body_count; i++) {
+    WaterBody &body = bodies[i];
+    if (pool != NULL && !clashes(body.view)) {
+      commit(body.view);
+      moved += body.moved;
+    }
+    else {
+      WaterView direct(target, pool != NULL);
+      moved += solve(body, direct);
+      if (pool != NULL) {
+        commit(direct);
       }
     }
   }
+  return moved;
 }
 
 
@@ -146,15 +312,26 @@ void FluidSimulator::run(CellGrid &orig_grid) {
 
 
 
+void SandGrid::copy_active(CellGrid &to, CellGrid &from) {
+  //Frozen cells are the same in both grids, so only the active part needs copying
+  if (&to == &from) return;
+  if (full_copy) {
+    to = from;
+  }
+  else {
+    to.copy_region(from, active.grow(1));
+    to.copy_speeds(from, active.grow(1));
+    to.ticks = from.ticks;
+  }
+}
+
 void SandGrid::toggle_parity() {
+  //Every other tick 'now' takes on what 'next' worked out. Swapping the
+  //grids does that without copying a cell: whatever's left in 'next' only
+  //differs inside the active region, and the next update copies over that.
   parity = !parity;
   if (parity) {
-    now = b;
-    next = a;
-  }
-  else {
-    now = a;
-    next = b;
+    a.swap(b);
   }
 }
 
@@ -173,122 +350,696 @@ bool SandGrid::touches_air(int x, int y) {
   return false;
 }
 
-SandGrid::SandGrid() : now(a), next(b), parity(false) {}
+SandGrid::SandGrid(int width, int height) : a(width, height), b(width, height), now(a), next(b), parity(false), settled(false), edited(false), full_copy(true), active(0, 0, width-1, height-1), pool(NULL), quiet_ticks(0), engine(PLAIN_ENGINE), tiles(NULL), bands(NULL), band_stale(false), counters(NULL), journal(NULL), history(NULL), clones(0), destroys(0), rules(STEP_RULES), block_region(0, 0, -1, -1), block_offset(0), block_quiet(0) {}
+
+SandGrid::~SandGrid() {
+  delete bands;
+  delete pool;
+  delete tiles;
+}
+
+void SandGrid::set_seed(Uint64 seed) {
+  random = Random(seed);
+}
+
+void SandGrid::set_engine(Engine e) {
+  engine = e;
+  if (engine == TILE_ENGINE && tiles == NULL) {
+    tiles = new TileCache();
+  }
+}
+
+void SandGrid::unsettle() {
+  //Something changed that the passes didn't do
+  settled = false;
+  block_quiet = 0;
+}
+
+void SandGrid::set_rules(Rules r) {
+  //Not an engine: it changes what the world does. The other engines and
+  //the bands only know STEP_RULES, so they sit the others out.
+  rules = r;
+  a.use_speeds(rules == VELOCITY_RULES);
+  b.use_speeds(rules == VELOCITY_RULES);
+  unsettle();
+}
+
+const TileCache::Stats *SandGrid::tile_stats() {
+  //NULL unless the tile engine has been used
+  if (bands != NULL && engine == TILE_ENGINE) {
+    return &bands->tile_stats();
+  }
+  return tiles != NULL ? &tiles->get_stats() : NULL;
+}
+
+void SandGrid::set_processes(int processes) {
+  //More than one keeps the world in bands of rows, each in its own process.
+  //Threads don't survive a fork, so the pool is let go while forking.
+  sync();
+  delete bands;
+  bands = NULL;
+  band_stale = false;
+  full_copy = true;
+  processes = std::min(processes, height()/4); //a band has to be taller than its halo
+  if (processes > 1) {
+    int threads = pool != NULL ? pool->size() : 1;
+    set_threads(1);
+    bands = new Bands(*this, processes);
+    set_threads(threads);
+  }
+}
+
+void SandGrid::set_threads(int threads) {
+  //More than one thread solves separate bodies of water at the same time
+  delete pool;
+  pool = threads > 1 ? new WorkerPool(threads) : NULL;
+  fluid_sim.set_pool(pool);
+}
 
-void SandGrid::draw(SDL_Surface *surface) {
-  next.draw(surface);
-  rectangleRGBA(surface, /*dimensions*/ 0, 0, screen_size+1, screen_size+1, /*color*/ 0x80, 0x80, 0x80, 0xFF);
+void SandGrid::draw(SDL_Surface *surface, const Viewport &view) {
+  sync();
+  edited = false;
+  SDL_FillRect(surface, NULL, CellData::color(AIR));
+  if (view.lod > 0) {
+    overview.draw(surface, now, view);
+  }
+  else {
+    renderer.draw(surface, now, view);
+  }
+  rectangleRGBA(surface, /*dimensions*/ view.screen_x(0), view.screen_y(0),
+      view.screen_x(width())+1, view.screen_y(height())+1, /*color*/ 0x80, 0x80, 0x80, 0xFF);
   SDL_UpdateRect(surface, 0, 0, 0, 0); //updates entire screen. Economical!
 }
 
+template <class Cells>
+void SandGrid::simple_physics_cell(int x, int y, Cells &out) {
+  //What the cell at (x, y) writes this tick. Only reads 'now'.
+  CellType now_cell = now.get(x, y);
+  CellType next_cell = now_cell; //By default, blocks carry over
+  switch (next_cell) {
+    case AIR: return;
+    case BAD_CELL_TYPE:
+    case CELL_TYPE_COUNT:
+      next_cell = ROCK;
+      break;
+    case SAND:
+      if (now.get(x, y+1) == AIR) {
+        //fall down
+        out.set(x, y+1, SAND);
+        next_cell = AIR;
+      }
+      break;
+    case INACTIVE_WATER:
+      if (touches_air(x, y)) {
+        next_cell = EXPOSED_WATER;
+      }
+      break;
+    case EXPOSED_WATER:
+      if (!touches_air(x, y)) {
+        next_cell = INACTIVE_WATER;
+      }
+      if (now.get(x, y+1, ROCK) == AIR) {
+        //fall down :O
+        out.set(x, y+1, EXPOSED_WATER);
+        next_cell = AIR;
+      }
+      else if (now.get(x-1, y, ROCK) == AIR
+          && now.get(x-1, y+1, ROCK) == AIR) {
+        //spill over
+        out.set(x-1, y+1, EXPOSED_WATER);
+        next_cell = AIR;
+      }
+      else if (now.get(x+1, y, ROCK) == AIR
+          && now.get(x+1, y+1, ROCK) == AIR) {
+        //spill over
+        out.set(x+1, y+1, EXPOSED_WATER);
+        next_cell = AIR;
+      }
+      break;
+    case ROCK: break; //BORING
+    default: break;
+  }
+  out.set(x, y, next_cell);
+}
+
 void SandGrid::simple_physics_pass() {
-  for (int x = 0; x < grid_size; x++) {
-    for (int y = 0; y < grid_size; y++) {
-      CellType now_cell = now.get(x, y);
-      CellType next_cell = now_cell; //By default, blocks carry over
-      switch (next_cell) {
-        case AIR: continue;
-        case BAD_CELL_TYPE:
-        case CELL_TYPE_COUNT:
-          next_cell = ROCK;
-          break;
-        case SAND:
-          if (now.get(x, y+1) == AIR) {
-            //fall down
-            next.set(x, y+1, SAND);
-            next_cell = AIR;
-          }
-          break;
-        case INACTIVE_WATER:
-          if (touches_air(x, y)) {
-            next_cell = EXPOSED_WATER;
-          }
-          break;
-        case EXPOSED_WATER:
-          if (!touches_air(x, y)) {
-            next_cell = INACTIVE_WATER;
-          }
-          if (now.get(x, y+1, ROCK) == AIR) {
-            //fall down :O
-            next.set(x, y+1, EXPOSED_WATER);
-            next_cell = AIR;
-          }
-          else if (now.get(x-1, y, ROCK) == AIR
-              && now.get(x-1, y+1, ROCK) == AIR) {
-            //spill over
-            next.set(x-1, y+1, EXPOSED_WATER);
-            next_cell = AIR;
-          }
-          else if (now.get(x+1, y, ROCK) == AIR
-              && now.get(x+1, y+1, ROCK) == AIR) {
-            //spill over
-            next.set(x+1, y+1, EXPOSED_WATER);
-            next_cell = AIR;
-          }
-          break;
-        case ROCK: break; //BORING
-        default: break;
+  for (int x = active.x0; x <= active.x1; x++) {
+    for (int y = active.y0; y <= active.y1; y++) {
+      simple_physics_cell(x, y, next);
+    }
+  }
+}
+
+bool SandGrid::fall(int x, int y) {
+  //Sand or water with air under it falls one cell a tick faster than it
+  //did the tick before, up to max_fall_speed, straight down through the
+  //air in 'now'. False for anything that isn't falling; that's left to
+  //simple_physics_cell.
+  CellType c = now.get(x, y);
+  if (c != SAND && c != EXPOSED_WATER) return false;
+  int speed = now.speed(x, y);
+  if (now.get(x, y+1) != AIR) {
+    //Landed, unless it's only resting on something that's falling too
+    if (speed && !now.speed(x, y+1)) next.set_speed(x, y, 0);
+    return false;
+  }
+  speed = std::min(speed + 1, max_fall_speed);
+  int bottom = std::min(y + speed, active.y1 + 1); //like everything else, one row past the active region at most
+  int to = y + 1;
+  while (to < bottom && now.get(x, to+1) == AIR
+      //Water next to the path could spill into the same cell; stop short
+      && now.get(x-1, to) != EXPOSED_WATER && now.get(x+1, to) != EXPOSED_WATER) {
+    to++;
+  }
+  next.set(x, y, AIR);
+  next.set_speed(x, y, 0);
+  next.set(x, to, c);
+  next.set_speed(x, to, to - y);
+  return true;
+}
+
+void SandGrid::velocity_physics_pass() {
+  //simple_physics_pass with things falling more than a cell a tick
+  for (int x = active.x0; x <= active.x1; x++) {
+    for (int y = active.y0; y <= active.y1; y++) {
+      if (!fall(x, y)) {
+        simple_physics_cell(x, y, next);
       }
-      next.set(x, y, next_cell);
     }
   }
 }
 
-void SandGrid::replicator_physics_pass() {
-  for (int x = 0; x < grid_size; x++) {
-    for (int y = 0; y < grid_size; y++) {
-      switch (next.get(x, y, AIR)) {
-        case CLONER:
-          if (now.get(x, y+1, ROCK) == AIR || now.get(x, y+1, ROCK) == CLONER) {
-            next.set(x, y+1, now.get(x, y-1, CLONER));
-          }
-          break;
-        case DESTROYER:
-          for (int dx = -1; dx != 2; dx++) {
-            for (int dy = -1; dy != 2; dy++) {
-              if (dx == 0 && dy == 0) continue;
-              next.set(x+dx, y+dy, AIR);
-            }
+const int block_rows_per_job = 16;
+
+void SandGrid::block_job(void *grid, int index) {
+  ((SandGrid *)grid)->block_rows(index);
+}
+
+void SandGrid::block_rows(int index) {
+  //One job's worth of block rows, all in block_plane. Blocks don't overlap,
+  //so jobs don't either.
+  int stride = block_region.x1 - block_region.x0 + 1;
+  int y0 = block_region.y0 + 1 + index*2*block_rows_per_job;
+  int y1 = std::min(y0 + 2*block_rows_per_job, block_region.y1); //past the last block row
+  for (int y = y0; y < y1; y += 2) {
+    Uint8 *top = &block_plane[(y - block_region.y0)*stride], *bottom = top + stride;
+    for (int x = 1; x + 1 < stride - 1; x += 2) {
+      for (int i = x; i <= x+1; i++) {
+        if (top[i] >= CELL_TYPE_COUNT) top[i] = ROCK;
+        if (bottom[i] >= CELL_TYPE_COUNT) bottom[i] = ROCK;
+      }
+      block_rules.apply(top[x], top[x+1], bottom[x], bottom[x+1]);
+    }
+  }
+}
+
+void SandGrid::block_physics_pass() {
+  /*
+  BLOCK_RULES: the world is cut into 2x2 blocks and each block that touches
+  the active region goes through block_rules, all independently, so with
+  threads they're shared out between the pool. The blocks shift by a cell
+  every other tick rather than every tick, because 'now' only keeps every
+  other tick's pass (see toggle_parity).
+  Then which water is exposed gets worked out again, one cell at a time.
+  */
+  Region world(0, 0, width()-1, height()-1);
+  block_offset = (now.ticks >> 1) & 1;
+  Region blocks(active.x0 - ((active.x0 - block_offset) & 1), active.y0 - ((active.y0 - block_offset) & 1),
+      active.x1 - ((active.x1 - block_offset) & 1) + 1, active.y1 - ((active.y1 - block_offset) & 1) + 1);
+  //A ring more around the blocks, to see what water touches; off the world is rock
+  block_region = blocks.grow(1);
+  int stride = block_region.x1 - block_region.x0 + 1;
+  block_plane.resize(stride*(block_region.y1 - block_region.y0 + 1));
+  now.read_region(block_region, &block_plane[0]);
+
+  int jobs = ((blocks.y1 - blocks.y0 + 1)/2 + block_rows_per_job - 1)/block_rows_per_job;
+  if (pool != NULL) {
+    pool->run(block_job, this, jobs);
+  }
+  else {
+    for (int i = 0; i < jobs; i++) {
+      block_rows(i);
+    }
+  }
+
+  Region out = blocks.clip(world);
+  for (int y = out.y0; y <= out.y1; y++) {
+    Uint8 *row = &block_plane[(y - block_region.y0)*stride] - block_region.x0;
+    for (int x = out.x0; x <= out.x1; x++) {
+      if ((row[x] == EXPOSED_WATER || row[x] == INACTIVE_WATER) && active.contains(x, y)) {
+        bool air = row[x-1] == AIR || row[x+1] == AIR || row[x-stride] == AIR || row[x+stride] == AIR;
+        row[x] = air ? EXPOSED_WATER : INACTIVE_WATER;
+      }
+    }
+    if (out.x0 == 0 && out.x1 == width()-1) {
+      next.write_row(y, row);
+    }
+    else {
+      for (int x = out.x0; x <= out.x1; x++) {
+        next.set(x, y, (CellType)row[x]);
+      }
+    }
+  }
+}
+
+struct RegionWriter {
+  //Catches the writes that land in one region, kept as bytes row by row
+  Region region;
+  Uint8 *cells;
+  int stride;
+
+  RegionWriter(Region r, Uint8 *c, int s) : region(r), cells(c), stride(s) {}
+  inline void set(int x, int y, CellType c) {
+    if (region.contains(x, y)) {
+      cells[(y - region.y0)*stride + (x - region.x0)] = c;
+    }
+  }
+};
+
+void SandGrid::tile_next(Region tile, Uint8 *out) {
+  //What simple_physics_pass leaves in the tile: what's there now, then
+  //whatever the cells around it write over it, in the same order.
+  for (int y = tile.y0; y <= tile.y1; y++) {
+    for (int x = tile.x0; x <= tile.x1; x++) {
+      out[(y - tile.y0)*tile_size + (x - tile.x0)] = now.get(x, y);
+    }
+  }
+  RegionWriter writer(tile, out, tile_size);
+  Region reach = tile.grow(1).clip(active);
+  for (int x = reach.x0; x <= reach.x1; x++) {
+    for (int y = reach.y0; y <= reach.y1; y++) {
+      simple_physics_cell(x, y, writer);
+    }
+  }
+}
+
+void SandGrid::simple_physics_band(Region rows, Region active, Uint8 *plane) {
+  //Like tile_next, for whole rows of a flat copy of the world (see Bands).
+  //Only reads 'now' around the rows.
+  RegionWriter writer(rows, plane + rows.y0*width(), width());
+  Region writers = Region(active.x0, rows.y0 - 1, active.x1, rows.y1).clip(active);
+  for (int x = writers.x0; x <= writers.x1; x++) {
+    for (int y = writers.y0; y <= writers.y1; y++) {
+      simple_physics_cell(x, y, writer);
+    }
+  }
+}
+
+void SandGrid::cached_physics_pass() {
+  /*
+  Same result as simple_physics_pass, a tile at a time. A cell only reads
+  its neighbours and only writes itself and the row below, so a tile's next
+  state depends on nothing further than tile_border cells away. Tiles with
+  every one of those writers active get looked up; the ones on the edge of
+  the active region are just worked out.
+  */
+  Region world(0, 0, width()-1, height()-1);
+  Region writable = active.grow(1).clip(world);
+  Uint8 key[tile_key_cells], result[tile_cells];
+  static const Uint8 empty_key[tile_key_cells] = {AIR};
+  for (int ty = writable.y0 & ~(tile_size-1); ty <= writable.y1; ty += tile_size) {
+    for (int tx = writable.x0 & ~(tile_size-1); tx <= writable.x1; tx += tile_size) {
+      Region tile(tx, ty, tx + tile_size-1, ty + tile_size-1);
+      Region reach = tile.grow(1).clip(world);
+      const Uint8 *next_cells = result;
+      if (tile.clip(world) == tile && reach.clip(active) == reach) {
+        //Off the edge of the world reads as rock, which never writes anything
+        now.read_region(tile.grow(tile_border), key);
+        if (!memcmp(key, empty_key, tile_key_cells)) {
+          tiles->empty();
+          continue; //nothing but air, nothing to write
+        }
+        Uint64 hash = TileCache::hash(key);
+        next_cells = tiles->find(key, hash);
+        if (next_cells == NULL) {
+          tile_next(tile, result);
+          tiles->insert(key, hash, result);
+          next_cells = result;
+        }
+      }
+      else {
+        tiles->uncached();
+        tile_next(tile, result);
+      }
+
+      Region part = tile.clip(writable);
+      for (int y = part.y0; y <= part.y1; y++) {
+        for (int x = part.x0; x <= part.x1; x++) {
+          next.set(x, y, (CellType)next_cells[(y - ty)*tile_size + (x - tx)]);
+        }
+      }
+    }
+  }
+}
+
+void SandGrid::replicator_physics_cell(int x, int y) {
+  //Whatever's at (x, y) in 'next' by now; a cloner can have just made it
+  switch (next.get(x, y, AIR)) {
+    case CLONER:
+      if (now.get(x, y+1, ROCK) == AIR || now.get(x, y+1, ROCK) == CLONER) {
+        CellType c = now.get(x, y-1, CLONER);
+        next.set(x, y+1, c);
+        clones += c != AIR;
+      }
+      break;
+    case DESTROYER:
+      for (int dx = -1; dx != 2; dx++) {
+        for (int dy = -1; dy != 2; dy++) {
+          if (dx == 0 && dy == 0) continue;
+          if (next.get(x+dx, y+dy, AIR) != AIR) {
+            next.set(x+dx, y+dy, AIR);
+            destroys++;
           }
-          break;
-        default: break;
+        }
       }
+      break;
+    default: break;
+  }
+}
+
+void SandGrid::replicator_physics_pass(Region cells) {
+  for (int x = cells.x0; x <= cells.x1; x++) {
+    for (int y = cells.y0; y <= cells.y1; y++) {
+      replicator_physics_cell(x, y);
     }
   }
 }
 
 void SandGrid::update(bool do_physics) {
-  next = now;
+  if (bands != NULL) {
+    if (rules == STEP_RULES) {
+      update_bands(do_physics);
+      return;
+    }
+    if (!band_stale) {
+      //The bands only know STEP_RULES; take the world back from them
+      sync();
+      band_stale = true;
+      full_copy = true;
+    }
+  }
+  //Edits since the last tick count as this tick's changes
+  if (changes.size() != now.chunk_count()) {
+    changes.resize(now.chunk_count());
+  }
+  changes.clear();
+  changes.add(now.written_chunks());
+  now.forget_written();
+  copy_active(next, now);
+  next.forget_written();
+  long long changed = 0, water_moved = 0, water_bodies = 0;
+  clones = destroys = 0;
   if (do_physics) {
-    simple_physics_pass();
-    replicator_physics_pass();
-    fluid_sim.run(now);
+    if (rules == VELOCITY_RULES) {
+      velocity_physics_pass();
+    }
+    else if (rules == BLOCK_RULES) {
+      block_physics_pass();
+    }
+    else if (engine == TILE_ENGINE) {
+      cached_physics_pass();
+    }
+    else {
+      simple_physics_pass();
+    }
+    replicator_physics_pass(active);
+    //The passes only look at the grid, so if this tick didn't change
+    //anything (and no water got shuffled around) the next one won't either.
+    settled = next.same_cells(now, active.grow(1));
+    if (counters != NULL && !settled) {
+      changed = next.count_different(now, active.grow(1));
+    }
+    water_moved = fluid_sim.run(now, active, random);
+    water_bodies = fluid_sim.bodies_found();
+    settled &= water_moved == 0;
+    if (rules == BLOCK_RULES) {
+      //A block that can't move might still once the blocks shift by a
+      //cell, so it takes a quiet tick at both offsets
+      block_quiet = settled ? block_quiet | (1 << block_offset) : 0;
+      settled = block_quiet == 3;
+    }
     now.ticks = ++next.ticks;
   }
+  //Whichever grid toggle_parity() keeps, its writes are the rest
+  changes.add(parity ? now.written_chunks() : next.written_chunks());
+  now.forget_written();
+  next.forget_written();
   toggle_parity();
+  compact();
+  full_copy = false;
+  if (counters != NULL) {
+    count(do_physics, changed, water_moved, water_bodies);
+  }
+  if (journal != NULL) {
+    journal->record(now, changes);
+  }
+  if (history != NULL) {
+    if (do_physics) history->record(now, changes, parity);
+    else history->note(changes);
+  }
+  overview.touch(changes);
+}
+
+void SandGrid::update_bands(bool do_physics) {
+  //update() with the world kept in the bands. Edits go out to them first;
+  //what the tick changed stays with them until sync().
+  if (changes.size() != now.chunk_count()) {
+    changes.resize(now.chunk_count());
+  }
+  changes.clear();
+  changes.add(now.written_chunks());
+  if (band_stale) {
+    changes.add_all();
+    full_copy = true;
+    band_stale = false;
+  }
+  bands->scatter(now, changes);
+  now.forget_written();
+  next.forget_written();
+  Bands::Tick tick = bands->tick(now, next, active, parity, do_physics, full_copy, counters != NULL, changes);
+  if (do_physics) {
+    settled = !tick.changed && tick.water_moved == 0;
+    now.ticks = next.ticks = now.ticks + 1;
+  }
+  clones = tick.clones;
+  destroys = tick.destroys;
+  now.forget_written();
+  next.forget_written();
+  //Our 'now' stays whatever we last saw until sync(), so it never swaps
+  parity = !parity;
+  compact();
+  full_copy = false;
+  if (counters != NULL || journal != NULL || history != NULL) {
+    sync();
+  }
+  if (counters != NULL) {
+    count(do_physics, tick.changed_cells, tick.water_moved, tick.water_bodies);
+  }
+  if (journal != NULL) {
+    journal->record(now, changes);
+  }
+  if (history != NULL) {
+    if (do_physics) history->record(now, changes, parity);
+    else history->note(changes);
+  }
+  overview.touch(changes);
+}
+
+void SandGrid::sync() {
+  //With bands, 'now' is only as new as the last time we asked them
+  if (bands != NULL && !band_stale && bands->gather(now, changes)) {
+    now.forget_written(); //not edits, nothing to send back
+    overview.touch(changes);
+  }
+}
+
+void SandGrid::compact() {
+  //Frozen cells never change, so they may as well stay packed; that only
+  //needs redoing after edits or a new active region. Everything gets packed
+  //once the world settles, and every so often the active chunks that didn't
+  //change this tick do too, since most of a big world sits still.
+  const int compact_interval = 64;
+  if (settled) {
+    a.compact(Region(0, 0, -1, -1));
+    b.compact(Region(0, 0, -1, -1));
+  }
+  else if (++quiet_ticks >= compact_interval) {
+    a.compact(active.grow(1), &b);
+    b.compact(active.grow(1), &a);
+    quiet_ticks = 0;
+  }
+  else if (full_copy) {
+    a.compact(active.grow(1));
+    b.compact(active.grow(1));
+  }
+}
+
+void SandGrid::count(bool do_physics, long long changed, long long water_moved, long long water_bodies) {
+  //One record for the counter ring, about the tick that just ran. The
+  //census keeps up with edits made while paused, but those get no record.
+  census.update(now, changes);
+  if (!do_physics) return;
+  sand_tick_counters record;
+  memset(&record, 0, sizeof(record));
+  record.tick = ticks();
+  memcpy(record.cells, census.cells(), sizeof(record.cells));
+  record.changed = changed;
+  record.water_moved = water_moved;
+  record.water_bodies = water_bodies;
+  record.dense_chunks = now.dense_chunks();
+  record.clones = clones;
+  record.destroys = destroys;
+  counters->push(record);
+}
+
+void SandGrid::set_counters(CounterRing *ring) {
+  //Every tick gets counted into 'ring' from now on; NULL stops it
+  counters = ring;
+  census.reset();
+}
+
+void SandGrid::set_journal(DeltaJournal *changes) {
+  //What each tick changed goes to 'changes' from now on; NULL stops it
+  if (changes != NULL && changes != journal) {
+    changes->resync();
+  }
+  journal = changes;
+}
+
+void SandGrid::set_history(TickHistory *ticks) {
+  //Keep past ticks in 'ticks' to rewind to, starting with this one
+  history = ticks;
+  if (history != NULL) {
+    sync();
+    history->restart(now, parity);
+  }
+}
+
+bool SandGrid::rewind(int tick) {
+  //Back to 'tick', or as near as the history goes; false without one
+  CellGrid cells(0, 0);
+  bool odd;
+  if (history == NULL || !history->rewind(tick, cells, odd)) {
+    return false;
+  }
+  restore(cells, odd);
+  history->share(now);
+  return true;
+}
+
+void SandGrid::set_active_region(Region region) {
+  //Only this part of the world gets simulated, everything else is frozen
+  region = region.clip(Region(0, 0, width()-1, height()-1));
+  if (region == active) return;
+  active = region;
+  unsettle();
+  full_copy = true;
+}
+
+bool SandGrid::is_settled() {
+  return settled;
+}
+
+bool SandGrid::idle(bool do_physics) {
+  //Nothing on screen will change until somebody edits the world
+  return !edited && (settled || !do_physics);
+}
+
+int SandGrid::ticks() {
+  return now.ticks;
+}
+
+int SandGrid::width() {
+  return now.get_width();
+}
+
+int SandGrid::height() {
+  return now.get_height();
+}
+
+const CellGrid &SandGrid::current() {
+  sync();
+  return now;
+}
+
+const ChunkSet &SandGrid::changed_chunks() {
+  //Chunks of current() that the last update() might have changed, edits
+  //made before it included; anything not in here is just as it was
+  return changes;
+}
+
+bool SandGrid::snapshot(CellGrid &copy) {
+  //A copy-on-write copy of the world, good for reading on another thread.
+  //Between ticks, the grid that isn't current gets recopied before it's
+  //used, so this plus the parity it returns is all restore() needs.
+  //Falling speeds are copied outright; only chunks with something falling
+  //have any.
+  sync();
+  now.freeze(copy);
+  if (now.has_speeds()) {
+    copy.use_speeds(true);
+    copy.copy_speeds(now, Region(0, 0, width()-1, height()-1));
+  }
+  return parity;
+}
+
+void SandGrid::restore(const CellGrid &cells, bool odd) {
+  //Every chunk counts as written, so it all goes out to any bands too
+  if (bands != NULL) {
+    bands->restored();
+  }
+  //Speeds come along if 'cells' has them and the rules want them
+  now = cells;
+  next = cells;
+  if (now.has_speeds() != (rules == VELOCITY_RULES)) {
+    now.use_speeds(rules == VELOCITY_RULES);
+    next.use_speeds(rules == VELOCITY_RULES);
+  }
+  parity = odd;
+  overview.touch(Region(0, 0, width()-1, height()-1));
+  unsettle();
+  edited = true;
+  full_copy = true;
+}
+
+size_t SandGrid::bytes() {
+  //Both copies of the cells
+  return a.bytes() + b.bytes();
 }
 
 CellType SandGrid::get(int x, int y) {
+  sync();
   return now.get(x, y);
 }
 
 CellType SandGrid::get(int x, int y, CellType default_type) {
+  sync();
   return now.get(x, y, default_type);
 }
 
 void SandGrid::set(int x, int y, CellType cell_type) {
+  sync();
   now.set(x, y, cell_type);
+  overview.touch(Region(x, y, x, y));
+  unsettle();
+  edited = true;
+  full_copy = true;
 }
 
-void SandGrid::mouse_set(CellType cell_type) {
+void SandGrid::apply(EditBatch &batch) {
+  if (batch.empty()) return;
+  sync();
+  batch.apply(now);
+  overview.touch(batch.bounds(Region(0, 0, width()-1, height()-1)));
+  unsettle();
+  edited = true;
+  full_copy = true;
+}
+
+void SandGrid::mouse_set(CellType cell_type, const Viewport &view) {
   int mouse_x, mouse_y;
   SDL_GetMouseState(&mouse_x, &mouse_y);
-  mouse_x /= block_pixel_size;
-  mouse_y /= block_pixel_size;
-  if (cell_type == BAD_CELL_TYPE) {
-    std::cout << "Mouse at: " << mouse_x << "," << mouse_y << std::endl;
-    SDL_Delay(1000);
-    return;
-  }
-  set(mouse_x, mouse_y, cell_type);
+  Coord here = view.to_cell(mouse_x, mouse_y);
+  set(here.x, here.y, cell_type);
 }
+
@@ -4,54 +4,193 @@
 
 
 #include <deque>
+#include <map>
 #include <stack>
+#include <vector>
 #include <algorithm>
 
 #include <SDL/SDL_gfxPrimitives.h>
 
 #include "common.h"
 #include "CellGrid.h"
+#include "Edits.h"
+#include "Viewport.h"
+#include "Overview.h"
+#include "GridRenderer.h"
+#include "WorkerPool.h"
+#include "Random.h"
+#include "TileCache.h"
+#include "Bands.h"
+#include "Counters.h"
+#include "Blocks.h"
+#include "Journal.h"
+#include "History.h"
 
 
 class FluidSimulator {
 private:
+  //How move_water sees the grid. Bodies solved on a worker keep what they
+  //read and write to themselves until it's their turn to commit.
+  struct WaterView {
+    CellGrid *grid;
+    bool deferred;
+    std::vector<Coord> reads;
+    std::map<Coord, CellType> writes; //only the last write to each cell
+
+    WaterView(CellGrid *g = NULL, bool defer = false);
+    void reset(CellGrid *g, bool defer);
+    CellType get(Coord p, CellType default_type);
+    void set(Coord p, CellType c);
+  };
+
+  struct WaterBody {
+    std::deque<Coord> exposed;
+    WaterView view;
+    int moved;
+  };
+
   CellGrid src;
+  Region bounds;
   std::deque<Coord> exposed;
   std::stack<Coord> branch;
+  std::vector<WaterBody> bodies;
+  Random random;
+  Uint32 tick;
+
+  WorkerPool *pool;
+  CellGrid *target;
+  std::vector<Uint32> written; //== run_count if an earlier body wrote it this run
+  Uint32 run_count;
+  int body_count; //found by the last run
 
+  CellType look(int x, int y);
   void add(int x, int y);
   void push(int x, int y);
   void pop(int &x, int &y);
 
   void flood_fill(int x, int y);
-  static bool height_sorter(Coord a, Coord b);
-  void move_water(CellGrid &grid, Coord move, Coord target);
+  bool move_water(WaterView &grid, Coord move, Coord target);
+  int solve(WaterBody &body, WaterView &view);
+  static void prepare_job(void *sim, int index);
+  static void solve_job(void *sim, int index);
+  bool written_this_run(Coord p);
+  bool clashes(const WaterView &view);
+  void commit(const WaterView &view);
+  void start(CellGrid &orig_grid, Region region, const Random &rng);
+  void find(int x, int y);
 public:
-  void run(CellGrid &orig_grid);
+  FluidSimulator();
+  void set_pool(WorkerPool *workers);
+  int run(CellGrid &orig_grid, Region region, const Random &rng);
+  void find_bodies(CellGrid &orig_grid, Region region, const Random &rng, const std::vector<Coord> &starts, const std::vector<int> *chunks);
+  int move_bodies();
+  int bodies_found();
+};
+
+
+
+//Ways of running the passes, all giving the same world
+enum Engine {
+  PLAIN_ENGINE,
+  TILE_ENGINE, //simple_physics_pass through a TileCache
+  ENGINE_COUNT //Leave last
 };
 
+//What the world does; unlike engines, these give different worlds
+enum Rules {
+  STEP_RULES, //simple_physics_pass, a cell at a time
+  VELOCITY_RULES, //falling things speed up, see fall()
+  BLOCK_RULES, //2x2 blocks through a table, see block_physics_pass()
+  RULES_COUNT //Leave last
+};
 
+const int max_fall_speed = 16; //cells a tick, with VELOCITY_RULES
 
 class SandGrid {
 private:
   CellGrid a, b;
   CellGrid &now, &next;
   bool parity;
+  bool settled; //The last tick changed nothing, so neither will the next one
+  bool edited; //Cells were set since the last draw
+  bool full_copy; //Frozen cells changed too, copy everything next time
+  Region active;
+  ChunkSet changes; //what the last update() changed, see changed_chunks()
   FluidSimulator fluid_sim;
-
+  Overview overview;
+  GridRenderer renderer;
+  WorkerPool *pool;
+  Random random;
+  int quiet_ticks; //since the last time everything got packed
+  Engine engine;
+  TileCache *tiles;
+  Bands *bands;
+  friend class Bands;
+  bool band_stale; //we've stepped the world ourselves, the bands need all of it
+  CounterRing *counters;
+  CellCensus census; //what's in 'now', for counters
+  DeltaJournal *journal;
+  TickHistory *history;
+  int clones, destroys; //cells cloned (other than air) and destroyed this tick
+  Rules rules;
+  std::vector<Uint8> block_plane; //block_physics_pass works on a flat copy of block_region
+  Region block_region;
+  int block_offset;
+  int block_quiet; //a bit for each block offset that's had a tick with nothing moving
+
+  SandGrid(const SandGrid &); //no copying, the grids point into each other
+  void unsettle();
+  void copy_active(CellGrid &to, CellGrid &from);
   void toggle_parity();
   bool touches_air(int x, int y);
+  template <class Cells> void simple_physics_cell(int x, int y, Cells &out);
   void simple_physics_pass();
-  void replicator_physics_pass();
+  bool fall(int x, int y);
+  void velocity_physics_pass();
+  static void block_job(void *grid, int index);
+  void block_rows(int index);
+  void block_physics_pass();
+  void tile_next(Region tile, Uint8 *out);
+  void cached_physics_pass();
+  void simple_physics_band(Region rows, Region active, Uint8 *plane);
+  void replicator_physics_cell(int x, int y);
+  void replicator_physics_pass(Region cells);
+  void compact();
+  void sync();
+  void update_bands(bool do_physics);
+  void count(bool do_physics, long long changed, long long water_moved, long long water_bodies);
 public:
-  SandGrid();
-  void draw(SDL_Surface *surface);
+  SandGrid(int width = grid_size, int height = grid_size);
+  ~SandGrid();
+  void set_threads(int threads);
+  void set_processes(int processes);
+  void set_counters(CounterRing *ring);
+  void set_journal(DeltaJournal *changes);
+  void set_history(TickHistory *ticks);
+  bool rewind(int tick);
+  void set_seed(Uint64 seed);
+  void set_engine(Engine e);
+  void set_rules(Rules r);
+  const TileCache::Stats *tile_stats();
+  void draw(SDL_Surface *surface, const Viewport &view);
   void update(bool do_physics);
+  void set_active_region(Region region);
+  bool is_settled();
+  bool idle(bool do_physics);
+  int ticks();
+  int width();
+  int height();
+  const CellGrid &current();
+  const ChunkSet &changed_chunks();
+  size_t bytes();
+  bool snapshot(CellGrid &copy);
+  void restore(const CellGrid &cells, bool odd);
 
   CellType get(int x, int y);
   CellType get(int x, int y, CellType default_type);
   void set(int x, int y, CellType cell_type);
-  void mouse_set(CellType cell_type);
+  void apply(EditBatch &batch);
+  void mouse_set(CellType cell_type, const Viewport &view);
 };
 
 
@@ -0,0 +1,18 @@
+
+#include "Random.h"
+
+static inline Uint64 mix(Uint64 z) {
+  //SplitMix64's finalizer
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+Random::Random(Uint64 s) : seed(s) {}
+
+Uint32 Random::at(Uint32 tick, int x, int y, Uint32 stream) const {
+  Uint64 h = mix(seed + 0x9E3779B97F4A7C15ULL*(tick + 1));
+  h = mix(h ^ (((Uint64)(Uint32)x << 32) | (Uint32)y));
+  h = mix(h + stream);
+  return (Uint32)(h >> 32);
+}
@@ -0,0 +1,23 @@
+
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <SDL/SDL.h>
+
+/*
+Counter based random numbers: the same seed, tick and cell always give the
+same number, whichever thread asks and in whatever order. There's no state
+to advance, so passes can be split up or reordered without changing what
+they roll.
+*/
+class Random {
+private:
+  Uint64 seed;
+
+public:
+  Random(Uint64 seed = 0);
+  Uint32 at(Uint32 tick, int x, int y, Uint32 stream = 0) const;
+  inline bool coin(Uint32 tick, int x, int y, Uint32 stream = 0) const { return at(tick, x, y, stream) & 1; }
+};
+
+#endif /* RANDOM_H */
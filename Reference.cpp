@@ -0,0 +1,289 @@
+#include "Reference.h"
+
+#include <algorithm>
+
+#include "Blocks.h"
+
+ReferenceGrid::ReferenceGrid(const CellGrid &start, Rules r, Uint64 seed) : width(start.get_width()), height(start.get_height()),
+    now(width*(size_t)height), rules(r), region(0, 0, width-1, height-1), random(seed), parity(false), settled(false), tick(start.ticks), block_quiet(0) {
+  for (int y = 0; y < height; y++) {
+    start.read_row(y, &now[y*width]);
+  }
+  next = now;
+  now_speed.assign(now.size(), 0);
+  next_speed = now_speed;
+}
+
+bool ReferenceGrid::touches_air(int x, int y) {
+  return get(now, x-1, y) == AIR || get(now, x+1, y) == AIR
+    || get(now, x, y-1) == AIR || get(now, x, y+1) == AIR || get(now, x, y) == AIR;
+}
+
+void ReferenceGrid::simple_cell(int x, int y) {
+  Uint8 next_cell = get(now, x, y);
+  switch (next_cell) {
+    case AIR: return;
+    case CELL_TYPE_COUNT:
+      next_cell = ROCK;
+      break;
+    case SAND:
+      if (get(now, x, y+1) == AIR) {
+        put(next, next_speed, x, y+1, SAND);
+        next_cell = AIR;
+      }
+      break;
+    case INACTIVE_WATER:
+      if (touches_air(x, y)) {
+        next_cell = EXPOSED_WATER;
+      }
+      break;
+    case EXPOSED_WATER:
+      if (!touches_air(x, y)) {
+        next_cell = INACTIVE_WATER;
+      }
+      if (get(now, x, y+1) == AIR) {
+        put(next, next_speed, x, y+1, EXPOSED_WATER);
+        next_cell = AIR;
+      }
+      else if (get(now, x-1, y) == AIR && get(now, x-1, y+1) == AIR) {
+        put(next, next_speed, x-1, y+1, EXPOSED_WATER);
+        next_cell = AIR;
+      }
+      else if (get(now, x+1, y) == AIR && get(now, x+1, y+1) == AIR) {
+        put(next, next_speed, x+1, y+1, EXPOSED_WATER);
+        next_cell = AIR;
+      }
+      break;
+    default: break;
+  }
+  put(next, next_speed, x, y, next_cell);
+}
+
+bool ReferenceGrid::fall(int x, int y) {
+  //VELOCITY_RULES, see SandGrid::fall
+  Uint8 c = get(now, x, y);
+  if (c != SAND && c != EXPOSED_WATER) return false;
+  int speed = get(now_speed, x, y, 0);
+  if (get(now, x, y+1) != AIR) {
+    if (speed && !get(now_speed, x, y+1, 0)) set(next_speed, x, y, 0);
+    return false;
+  }
+  speed = std::min(speed + 1, max_fall_speed);
+  int bottom = std::min(y + speed, region.y1 + 1);
+  int to = y + 1;
+  while (to < bottom && get(now, x, to+1) == AIR
+      && get(now, x-1, to) != EXPOSED_WATER && get(now, x+1, to) != EXPOSED_WATER) {
+    to++;
+  }
+  put(next, next_speed, x, y, AIR);
+  set(next_speed, x, y, 0);
+  put(next, next_speed, x, to, c);
+  set(next_speed, x, to, to - y);
+  return true;
+}
+
+void ReferenceGrid::block_pass() {
+  //BLOCK_RULES, see SandGrid::block_physics_pass. The world sits in a
+  //plane with two cells of rock around it.
+  int stride = width + 4;
+  plane.assign(stride*(height + 4), ROCK);
+  for (int y = 0; y < height; y++) {
+    std::copy(&now[y*width], &now[y*width] + width, &plane[(y+2)*stride + 2]);
+  }
+  //Only blocks with a cell in the region
+  int offset = (tick >> 1) & 1;
+  for (int y = 2 - offset; y < height + 2; y += 2) {
+    for (int x = 2 - offset; x < width + 2; x += 2) {
+      if (x-1 < region.x0 || x-2 > region.x1 || y-1 < region.y0 || y-2 > region.y1) continue;
+      Uint8 *top = &plane[y*stride + x], *bottom = top + stride;
+      for (int i = 0; i < 2; i++) {
+        if (top[i] >= CELL_TYPE_COUNT) top[i] = ROCK;
+        if (bottom[i] >= CELL_TYPE_COUNT) bottom[i] = ROCK;
+      }
+      block_rules.apply(top[0], top[1], bottom[0], bottom[1]);
+    }
+  }
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      Uint8 *cell = &plane[(y+2)*stride + x+2];
+      if ((*cell == EXPOSED_WATER || *cell == INACTIVE_WATER) && region.contains(x, y)) {
+        bool air = cell[-1] == AIR || cell[1] == AIR || cell[-stride] == AIR || cell[stride] == AIR;
+        *cell = air ? EXPOSED_WATER : INACTIVE_WATER;
+      }
+      next[y*width + x] = *cell;
+    }
+  }
+}
+
+void ReferenceGrid::replicator_pass() {
+  for (int x = region.x0; x <= region.x1; x++) {
+    for (int y = region.y0; y <= region.y1; y++) {
+      switch (get(next, x, y, AIR)) {
+        case CLONER:
+          if (get(now, x, y+1) == AIR || get(now, x, y+1) == CLONER) {
+            put(next, next_speed, x, y+1, get(now, x, y-1, CLONER));
+          }
+          break;
+        case DESTROYER:
+          for (int dx = -1; dx != 2; dx++) {
+            for (int dy = -1; dy != 2; dy++) {
+              if (dx == 0 && dy == 0) continue;
+              put(next, next_speed, x+dx, y+dy, AIR);
+            }
+          }
+          break;
+        default: break;
+      }
+    }
+  }
+}
+
+Uint8 ReferenceGrid::look(int x, int y) {
+  //Outside the region is the edge of the world
+  return region.contains(x, y) ? get(src, x, y) : AIR;
+}
+
+void ReferenceGrid::add(int x, int y) {
+  if (look(x, y) == EXPOSED_WATER) {
+    exposed.push_back(Coord(x, y));
+    set(src, x, y, AIR);
+  }
+}
+
+void ReferenceGrid::flood_fill(int x, int y) {
+  //Exactly FluidSimulator::flood_fill
+  add(x, y);
+  branch.push_back(Coord(x+1, y));
+  branch.push_back(Coord(x-1, y));
+  branch.push_back(Coord(x, y+1));
+  branch.push_back(Coord(x, y-1));
+  while (branch.size()) {
+    x = branch.back().x;
+    y = branch.back().y;
+    branch.pop_back();
+    while (look(x, y) == INACTIVE_WATER) y--;
+    add(x, y);
+    y++;
+    bool span_left = false, span_right = false;
+    while (y <= region.y1 && look(x, y) == INACTIVE_WATER) {
+      set(src, x, y, ROCK);
+      add(x-1, y);
+      add(x+1, y);
+      if (!span_left && look(x-1, y) == INACTIVE_WATER) {
+        branch.push_back(Coord(x-1, y));
+        span_left = true;
+      }
+      else if (span_left && look(x-1, y) != INACTIVE_WATER) {
+        span_left = false;
+      }
+      if (!span_right && look(x+1, y) == INACTIVE_WATER) {
+        branch.push_back(Coord(x+1, y));
+        span_right = true;
+      }
+      else if (span_right && look(x+1, y) != INACTIVE_WATER) {
+        span_right = false;
+      }
+      y++;
+    }
+    add(x, y);
+  }
+}
+
+bool ReferenceGrid::move_water(Coord move, Coord target) {
+  if (move.y + 1 >= target.y) return false;
+  bool left_first = random.coin(tick, target.x, target.y);
+  Coord first = left_first ? target.left() : target.right();
+  Coord second = left_first ? target.right() : target.left();
+  Coord to = target;
+  if (get(now, target.x, target.y+1) == AIR) to = target.down();
+  else if (get(now, first.x, first.y) == AIR) to = first;
+  else if (get(now, second.x, second.y) == AIR) to = second;
+  else if (get(now, target.x, target.y-1) == AIR) to = target.up();
+  else return false;
+  put(now, now_speed, to.x, to.y, EXPOSED_WATER);
+  put(now, now_speed, move.x, move.y, AIR);
+  return true;
+}
+
+int ReferenceGrid::fluid_step() {
+  //Every body in scan order, each solved before the next is looked at
+  src = now;
+  int moved = 0;
+  for (int x = region.x0; x <= region.x1; x++) {
+    for (int y = region.y0; y <= region.y1; y++) {
+      if (src[y*width + x] != EXPOSED_WATER) continue;
+      exposed.clear();
+      flood_fill(x, y);
+      sort(exposed.begin(), exposed.end());
+      unique(exposed.begin(), exposed.end()); //not erased, just like FluidSimulator
+      for (int i = 0, j = (int)exposed.size() - 1; j - i + 1 > 2; i++, j--) {
+        moved += move_water(exposed[i], exposed[j]);
+      }
+    }
+  }
+  return moved;
+}
+
+void ReferenceGrid::set_region(Region r) {
+  region = r.clip(Region(0, 0, width-1, height-1));
+}
+
+void ReferenceGrid::update() {
+  next = now;
+  next_speed = now_speed;
+  if (rules == BLOCK_RULES) {
+    block_pass();
+  }
+  else {
+    for (int x = region.x0; x <= region.x1; x++) {
+      for (int y = region.y0; y <= region.y1; y++) {
+        if (rules != VELOCITY_RULES || !fall(x, y)) {
+          simple_cell(x, y);
+        }
+      }
+    }
+  }
+  replicator_pass();
+  settled = next == now;
+  settled &= fluid_step() == 0;
+  if (rules == BLOCK_RULES) {
+    //Quiet at both block offsets
+    int offset = (tick >> 1) & 1;
+    block_quiet = settled ? block_quiet | (1 << offset) : 0;
+    settled = block_quiet == 3;
+  }
+  tick++;
+  parity = !parity;
+  if (parity) {
+    now = next;
+    now_speed = next_speed;
+  }
+}
+
+int ReferenceGrid::ticks() const {
+  return tick;
+}
+
+bool ReferenceGrid::is_settled() const {
+  return settled;
+}
+
+Rules ReferenceGrid::get_rules() const {
+  return rules;
+}
+
+int ReferenceGrid::get_width() const {
+  return width;
+}
+
+int ReferenceGrid::get_height() const {
+  return height;
+}
+
+const Uint8 *ReferenceGrid::cells() const {
+  return &now[0];
+}
+
+CellType ReferenceGrid::get(int x, int y) const {
+  return (CellType)get(now, x, y);
+}
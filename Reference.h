@@ -0,0 +1,80 @@
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+#include <vector>
+
+#include "CellGrid.h"
+#include "Physics.h"
+#include "Random.h"
+
+/*
+The engine done the plain way, as the yardstick for --diff (see Diff.h):
+the whole world in two flat arrays, every pass a cell at a time over all
+of it, bodies of water solved one after another, and 'next' copied over
+'now' every other tick. None of SandGrid's chunks, grid swapping, caches,
+threads or bands, so whatever those get wrong shows up as a difference.
+Keep it dull; when the rules change, change them here too.
+
+set_region() simulates part of the world the way
+SandGrid::set_active_region does: only cells in the region move, water and
+replicators in it can still reach a cell past its edge, and everything
+else stays as it was. It's just a bound on every pass here; nothing else
+depends on it.
+*/
+class ReferenceGrid {
+private:
+  int width, height;
+  std::vector<Uint8> now, next;
+  std::vector<Uint8> now_speed, next_speed; //VELOCITY_RULES
+  std::vector<Uint8> src, plane; //scratch for the fluid step and the blocks
+  std::vector<Coord> exposed, branch;
+  Rules rules;
+  Region region; //what gets simulated
+  Random random;
+  bool parity, settled;
+  int tick;
+  int block_quiet;
+
+  inline bool in_world(int x, int y) const {
+    return x >= 0 && y >= 0 && x < width && y < height;
+  }
+  inline Uint8 get(const std::vector<Uint8> &cells, int x, int y, Uint8 default_type = ROCK) const {
+    return in_world(x, y) ? cells[y*width + x] : default_type;
+  }
+  inline void set(std::vector<Uint8> &cells, int x, int y, Uint8 c) {
+    if (in_world(x, y)) cells[y*width + x] = c;
+  }
+  //set() for cells with speeds: one that turns into something else stops falling
+  inline void put(std::vector<Uint8> &cells, std::vector<Uint8> &speeds, int x, int y, Uint8 c) {
+    if (in_world(x, y) && cells[y*width + x] != c) {
+      cells[y*width + x] = c;
+      speeds[y*width + x] = 0;
+    }
+  }
+
+  bool touches_air(int x, int y);
+  void simple_cell(int x, int y);
+  bool fall(int x, int y);
+  void block_pass();
+  void replicator_pass();
+
+  Uint8 look(int x, int y);
+  void add(int x, int y);
+  void flood_fill(int x, int y);
+  bool move_water(Coord move, Coord target);
+  int fluid_step();
+
+public:
+  ReferenceGrid(const CellGrid &start, Rules rules, Uint64 seed);
+  void set_region(Region r);
+  void update();
+  int ticks() const;
+  bool is_settled() const;
+  Rules get_rules() const;
+  int get_width() const;
+  int get_height() const;
+  const Uint8 *cells() const; //row after row
+  CellType get(int x, int y) const;
+};
+
+#endif /* REFERENCE_H */
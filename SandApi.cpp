@@ -0,0 +1,216 @@
+
+#include "sand.h"
+#include "Physics.h"
+#include "Snapshot.h"
+
+#include <stddef.h>
+
+//sand.h promises these line up
+typedef char sand_cell_values_match[((int)SAND_DESTROYER == (int)DESTROYER && (int)SAND_CELL_COUNT == (int)CELL_TYPE_COUNT) ? 1 : -1];
+typedef char sand_rules_values_match[((int)SAND_RULES_BLOCKS == (int)BLOCK_RULES && (int)SAND_RULES_COUNT == (int)RULES_COUNT) ? 1 : -1];
+typedef char sand_change_layout_matches[(sizeof(sand_change) == sizeof(CellChange) && offsetof(sand_change, is) == offsetof(CellChange, is)) ? 1 : -1];
+typedef char sand_engine_values_match[((int)SAND_ENGINE_TILES == (int)TILE_ENGINE && (int)SAND_ENGINE_COUNT == (int)ENGINE_COUNT) ? 1 : -1];
+
+struct sand_world {
+  SandGrid grid;
+  EditBatch edits;
+  std::vector<Uint8> cells; //for sand_cells(), laid out flat
+  ChunkSet stale; //chunks of 'cells' that are out of date
+  CounterRing counters;
+  SnapshotWriter snapshots;
+  DeltaJournal journal;
+  DeltaStream stream;
+  TickHistory history;
+  sand_tick_callback callback;
+  void *user;
+  sand_changes_callback changes_callback;
+  void *changes_user;
+
+  sand_world(int width, int height) : grid(width, height), cells(width*(size_t)height), stale(grid.current().chunk_count()), callback(NULL), user(NULL), changes_callback(NULL), changes_user(NULL) {
+    stale.add_all();
+  }
+};
+
+static CellType cell_type(int cell) {
+  if (cell < FIRST_CELL_TYPE || cell >= CELL_TYPE_COUNT) {
+    return ROCK; //same thing the physics turns bad cells into
+  }
+  return (CellType)cell;
+}
+
+sand_world *sand_create(int width, int height) {
+  if (width <= 0 || height <= 0) return NULL;
+  return new sand_world(width, height);
+}
+
+void sand_destroy(sand_world *world) {
+  delete world;
+}
+
+int sand_width(sand_world *world) {
+  return world->grid.width();
+}
+
+int sand_height(sand_world *world) {
+  return world->grid.height();
+}
+
+int sand_ticks(sand_world *world) {
+  return world->grid.ticks();
+}
+
+int sand_settled(sand_world *world) {
+  return world->edits.empty() && world->grid.is_settled();
+}
+
+int sand_step(sand_world *world, int ticks) {
+  sand_apply_edits(world);
+  int ran = 0;
+  for (; ran < ticks && !world->grid.is_settled(); ran++) {
+    world->grid.update(true);
+    world->stale.add(world->grid.changed_chunks());
+    if (world->callback != NULL) {
+      world->callback(world, world->grid.ticks(), world->user);
+    }
+  }
+  return ran;
+}
+
+void sand_set_tick_callback(sand_world *world, sand_tick_callback callback, void *user) {
+  world->callback = callback;
+  world->user = user;
+}
+
+void sand_set_seed(sand_world *world, unsigned long long seed) {
+  world->grid.set_seed(seed);
+}
+
+void sand_set_threads(sand_world *world, int threads) {
+  world->grid.set_threads(threads);
+}
+
+void sand_set_active_region(sand_world *world, int x0, int y0, int x1, int y1) {
+  world->grid.set_active_region(Region(x0, y0, x1, y1));
+}
+
+void sand_set_engine(sand_world *world, int engine) {
+  if (engine < 0 || engine >= ENGINE_COUNT) return;
+  world->grid.set_engine((Engine)engine);
+}
+
+void sand_set_rules(sand_world *world, int rules) {
+  if (rules >= 0 && rules < RULES_COUNT) {
+    world->grid.set_rules((Rules)rules);
+  }
+}
+
+void sand_set_velocity(sand_world *world, int on) {
+  world->grid.set_rules(on ? VELOCITY_RULES : STEP_RULES);
+}
+
+void sand_tile_stats(sand_world *world, unsigned long *hits, unsigned long *misses) {
+  const TileCache::Stats *stats = world->grid.tile_stats();
+  if (hits != NULL) *hits = stats != NULL ? stats->hits : 0;
+  if (misses != NULL) *misses = stats != NULL ? stats->misses : 0;
+}
+
+int sand_publish_counters(sand_world *world, const char *name) {
+  if (name != NULL && !world->counters.publish(name)) {
+    return -1;
+  }
+  world->grid.set_counters(&world->counters);
+  return 0;
+}
+
+int sand_last_counters(sand_world *world, sand_tick_counters *counters) {
+  Uint64 head = world->counters.head();
+  return head > 0 && world->counters.read(head - 1, *counters);
+}
+
+static void pass_changes(int tick, const CellChange *changes, int count, void *world) {
+  sand_world *w = (sand_world *)world;
+  w->changes_callback(w, tick, (const sand_change *)changes, count, w->changes_user);
+}
+
+void sand_set_changes_callback(sand_world *world, sand_changes_callback callback, void *user) {
+  world->journal.unsubscribe(pass_changes, world);
+  world->changes_callback = callback;
+  world->changes_user = user;
+  if (callback != NULL) {
+    world->journal.subscribe(pass_changes, world);
+    world->grid.set_journal(&world->journal);
+  }
+}
+
+int sand_stream_changes(sand_world *world, const char *path) {
+  if (!world->stream.open(path, world->grid.width(), world->grid.height(), world->journal)) {
+    return -1;
+  }
+  world->grid.set_journal(&world->journal);
+  return 0;
+}
+
+void sand_keep_history(sand_world *world, int ticks, unsigned long max_bytes) {
+  world->history.set_limits(ticks, max_bytes);
+  world->grid.set_history(ticks > 0 ? &world->history : NULL);
+}
+
+int sand_rewind(sand_world *world, int tick) {
+  world->edits.clear();
+  return world->grid.rewind(tick) ? world->grid.ticks() : -1;
+}
+
+int sand_save_snapshot(sand_world *world, const char *path) {
+  return world->snapshots.save(world->grid, path) ? 0 : -1;
+}
+
+int sand_wait_snapshots(sand_world *world) {
+  return world->snapshots.wait() ? 0 : -1;
+}
+
+int sand_load_snapshot(sand_world *world, const char *path) {
+  world->snapshots.wait();
+  return load_snapshot(world->grid, path) ? 0 : -1;
+}
+
+void sand_fill_span(sand_world *world, int x0, int x1, int y, int cell) {
+  world->edits.span(x0, x1, y, cell_type(cell));
+}
+
+void sand_fill_rect(sand_world *world, int x0, int y0, int x1, int y1, int cell) {
+  world->edits.rect(Coord(x0, y0), Coord(x1, y1), cell_type(cell));
+}
+
+void sand_draw_line(sand_world *world, int x0, int y0, int x1, int y1, int radius, int cell) {
+  world->edits.line(Coord(x0, y0), Coord(x1, y1), cell_type(cell), radius);
+}
+
+void sand_fill_circle(sand_world *world, int x, int y, int radius, int cell) {
+  world->edits.circle(Coord(x, y), radius, cell_type(cell));
+}
+
+void sand_flood_replace(sand_world *world, int x, int y, int cell) {
+  world->edits.flood_replace(Coord(x, y), cell_type(cell));
+}
+
+void sand_apply_edits(sand_world *world) {
+  world->grid.apply(world->edits);
+  world->edits.clear();
+}
+
+const unsigned char *sand_cells(sand_world *world, int *stride) {
+  //The grid keeps its cells in chunks, so keep a flat copy and only redo
+  //the chunks that ticks or edits (or rewinds and loads) have touched since
+  const CellGrid &cells = world->grid.current();
+  world->stale.add(world->grid.changed_chunks()); //bands only hand them over now
+  world->stale.add(cells.written_chunks());
+  const std::vector<int> &stale = world->stale.list();
+  for (size_t i = 0; i < stale.size(); i++) {
+    cells.read_chunk(stale[i], &world->cells[0], cells.get_width());
+  }
+  world->stale.clear();
+  if (stride != NULL) {
+    *stride = cells.get_width();
+  }
+  return &world->cells[0];
+}
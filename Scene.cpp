@@ -0,0 +1,33 @@
+
+#include "Scene.h"
+
+#include <fstream>
+#include <string>
+
+using namespace std;
+
+bool load_scene(SandGrid &grid, const char *path) {
+  ifstream fd(path);
+  if (!fd) {
+    cerr << "Can't open scene " << path << endl;
+    return false;
+  }
+  EditBatch batch;
+  string line;
+  for (int y = 0; getline(fd, line); y++) {
+    for (int x = 0; x < (int)line.size(); x++) {
+      wchar_t initial = line[x];
+      if (initial == L'.' || initial == L' ') {
+        initial = L'a';
+      }
+      CellType cell_type = CellData::lookup(initial);
+      if (cell_type == BAD_CELL_TYPE) {
+        cerr << path << ": bad cell '" << line[x] << "' at " << Coord(x, y) << endl;
+        return false;
+      }
+      batch.point(Coord(x, y), cell_type); //runs get merged into spans
+    }
+  }
+  grid.apply(batch);
+  return true;
+}
@@ -0,0 +1,13 @@
+
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "Physics.h"
+
+/*
+Scenes are plain text, one line per row. Each character is the initial
+letter of a cell type (see CellData::lookup), '.' and ' ' are air.
+*/
+bool load_scene(SandGrid &grid, const char *path);
+
+#endif /* SCENE_H */
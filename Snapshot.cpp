@@ -0,0 +1,224 @@
+
+#include "Snapshot.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <zlib.h>
+
+using namespace std;
+
+const char snapshot_magic[8] = {'S', 'A', 'N', 'D', 'S', 'N', 'A', 'P'};
+const Uint32 snapshot_version = 1;
+const int header_size = 8 + 5*4;
+
+static void put32(Uint8 *out, Uint32 v) {
+  for (int i = 0; i < 4; i++) out[i] = v >> (8*i);
+}
+
+static Uint32 get32(const Uint8 *in) {
+  return in[0] | (in[1] << 8) | (in[2] << 16) | ((Uint32)in[3] << 24);
+}
+
+static bool read_header(FILE *f, Uint32 *fields) {
+  Uint8 header[header_size];
+  if (fread(header, 1, header_size, f) != (size_t)header_size) return false;
+  if (memcmp(header, snapshot_magic, 8)) return false;
+  for (int i = 0; i < 5; i++) {
+    fields[i] = get32(header + 8 + 4*i);
+  }
+  return fields[0] == snapshot_version;
+}
+
+bool write_snapshot(const CellGrid &cells, bool odd, const char *path) {
+  //Into a temporary file first, so a crash never leaves half a snapshot
+  string temp = string(path) + ".tmp";
+  FILE *f = fopen(temp.c_str(), "wb");
+  if (f == NULL) {
+    perror(temp.c_str());
+    return false;
+  }
+  int width = cells.get_width(), height = cells.get_height();
+  Uint8 header[header_size];
+  memcpy(header, snapshot_magic, 8);
+  put32(header + 8, snapshot_version);
+  put32(header + 12, width);
+  put32(header + 16, height);
+  put32(header + 20, cells.ticks);
+  put32(header + 24, (odd ? 1 : 0) | (cells.has_speeds() ? 2 : 0));
+  bool ok = fwrite(header, 1, header_size, f) == (size_t)header_size;
+
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  ok = ok && deflateInit(&z, 6) == Z_OK;
+  //The cells, then the speeds if there are any, as one run of rows
+  int rows = cells.has_speeds() ? 2*height : height;
+  vector<Uint8> row(width), out(64*1024);
+  for (int y = 0; ok && y <= rows; y++) {
+    if (y < height) {
+      cells.read_row(y, &row[0]);
+    }
+    else if (y < rows) {
+      cells.read_speed_row(y - height, &row[0]);
+    }
+    if (y < rows) {
+      z.next_in = &row[0];
+      z.avail_in = width;
+    }
+    int flush = y < rows ? Z_NO_FLUSH : Z_FINISH;
+    int result;
+    do {
+      z.next_out = &out[0];
+      z.avail_out = out.size();
+      result = deflate(&z, flush);
+      size_t size = out.size() - z.avail_out;
+      if (result == Z_STREAM_ERROR || fwrite(&out[0], 1, size, f) != size) {
+        ok = false;
+        break;
+      }
+    } while (z.avail_out == 0 || (flush == Z_FINISH && result != Z_STREAM_END));
+  }
+  deflateEnd(&z);
+
+  if (fclose(f) || !ok) {
+    cerr << "Couldn't write " << temp << endl;
+    remove(temp.c_str());
+    return false;
+  }
+  if (rename(temp.c_str(), path)) {
+    perror(path);
+    return false;
+  }
+  return true;
+}
+
+bool read_snapshot_size(const char *path, int &width, int &height) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) return false;
+  Uint32 fields[5];
+  bool ok = read_header(f, fields);
+  fclose(f);
+  if (ok) {
+    width = fields[1];
+    height = fields[2];
+  }
+  return ok;
+}
+
+bool load_snapshot(SandGrid &grid, const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    perror(path);
+    return false;
+  }
+  Uint32 fields[5];
+  if (!read_header(f, fields)) {
+    cerr << path << " isn't a snapshot" << endl;
+    fclose(f);
+    return false;
+  }
+  int width = fields[1], height = fields[2];
+  if (width != grid.width() || height != grid.height()) {
+    cerr << path << " is " << width << "x" << height << ", not "
+      << grid.width() << "x" << grid.height() << endl;
+    fclose(f);
+    return false;
+  }
+
+  CellGrid cells(width, height);
+  cells.ticks = fields[3];
+  int rows = fields[4] & 2 ? 2*height : height;
+  cells.use_speeds(rows > height);
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  bool ok = inflateInit(&z) == Z_OK;
+  vector<Uint8> row(width), in(64*1024);
+  int result = Z_OK;
+  for (int y = 0; ok && y < rows; y++) {
+    z.next_out = &row[0];
+    z.avail_out = width;
+    while (ok && z.avail_out) {
+      if (z.avail_in == 0) {
+        z.avail_in = fread(&in[0], 1, in.size(), f);
+        z.next_in = &in[0];
+      }
+      if (result == Z_STREAM_END || (z.avail_in == 0 && ferror(f))) {
+        ok = false;
+        break;
+      }
+      result = inflate(&z, Z_NO_FLUSH);
+      if (result != Z_OK && result != Z_STREAM_END) ok = false;
+      if (result == Z_OK && z.avail_in == 0 && feof(f) && z.avail_out) ok = false;
+    }
+    if (y >= height) {
+      if (ok) cells.write_speed_row(y - height, &row[0]);
+      continue;
+    }
+    for (int x = 0; ok && x < width; x++) {
+      if (row[x] >= CELL_TYPE_COUNT) ok = false;
+    }
+    if (ok) cells.write_row(y, &row[0]);
+  }
+  inflateEnd(&z);
+  fclose(f);
+  if (!ok) {
+    cerr << path << " is cut short or damaged" << endl;
+    return false;
+  }
+  cells.compact(Region(0, 0, -1, -1));
+  grid.restore(cells, fields[4] & 1);
+  return true;
+}
+
+SnapshotWriter::SnapshotWriter() : frozen(0, 0), odd(false), thread(NULL), finished(1), failed(false), saved(0), skipped(0) {}
+
+SnapshotWriter::~SnapshotWriter() {
+  wait();
+}
+
+int SnapshotWriter::writer(void *self) {
+  SnapshotWriter *w = (SnapshotWriter *)self;
+  w->failed = !write_snapshot(w->frozen, w->odd, w->path.c_str());
+  //Let go of the shared chunks, so the world doesn't have to copy them
+  w->frozen.clear();
+  __sync_synchronize();
+  w->finished = 1;
+  return 0;
+}
+
+bool SnapshotWriter::save(SandGrid &grid, const char *to) {
+  if (busy()) {
+    skipped++;
+    return false;
+  }
+  bool worked = wait();
+  path = to;
+  odd = grid.snapshot(frozen);
+  finished = 0;
+  thread = SDL_CreateThread(writer, this);
+  if (thread == NULL) {
+    sdl_error();
+  }
+  saved++;
+  return worked;
+}
+
+bool SnapshotWriter::busy() {
+  return thread != NULL && !finished;
+}
+
+bool SnapshotWriter::wait() {
+  if (thread != NULL) {
+    SDL_WaitThread(thread, NULL);
+    thread = NULL;
+  }
+  return !failed;
+}
+
+int SnapshotWriter::saves() {
+  return saved;
+}
+
+int SnapshotWriter::skips() {
+  return skipped;
+}
@@ -0,0 +1,54 @@
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+
+#include <SDL/SDL.h>
+#include <SDL/SDL_thread.h>
+
+#include "Physics.h"
+
+/*
+Snapshots are the whole world, enough to carry on exactly where it left
+off: "SANDSNAP", then little endian 32 bit version, width, height, ticks
+and flags (1 if the parity was odd, 2 if falling speeds follow the
+cells), then the cells row by row, one byte each, and the speeds the
+same way under --rules velocity, all deflated with zlib.
+
+SnapshotWriter saves on its own thread so the world doesn't stop ticking.
+Taking the copy is cheap (see Chunk::freeze); only the chunks the world
+writes to while the file's being written ever get copied. If a save is
+asked for while the last one is still going it's skipped, not queued.
+*/
+bool write_snapshot(const CellGrid &cells, bool odd, const char *path);
+//False if 'path' isn't a snapshot
+bool read_snapshot_size(const char *path, int &width, int &height);
+bool load_snapshot(SandGrid &grid, const char *path);
+
+class SnapshotWriter {
+private:
+  CellGrid frozen;
+  bool odd;
+  std::string path;
+  SDL_Thread *thread;
+  volatile int finished;
+  bool failed;
+  int saved, skipped;
+
+  SnapshotWriter(const SnapshotWriter &);
+  static int writer(void *self);
+
+public:
+  SnapshotWriter();
+  ~SnapshotWriter();
+  //False if it was skipped or the last save failed
+  bool save(SandGrid &grid, const char *path);
+  bool busy();
+  //True if the last save worked
+  bool wait();
+  int saves();
+  int skips();
+};
+
+#endif /* SNAPSHOT_H */
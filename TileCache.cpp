@@ -0,0 +1,95 @@
+
+#include "TileCache.h"
+
+#include <string.h>
+
+TileCache::Stats::Stats() : hits(0), misses(0), evictions(0), uncached(0), empty(0) {}
+
+TileCache::TileCache(int capacity) : buckets(capacity*2, -1), capacity(capacity), newest(-1), oldest(-1) {
+  //capacity*2 buckets keeps the chains short; has to be a power of two
+  entries.reserve(capacity);
+}
+
+Uint64 TileCache::hash(const Uint8 *key) {
+  //A word at a time
+  Uint64 h = 0x9E3779B97F4A7C15ULL;
+  for (int i = 0; i < tile_key_cells; i += 8) {
+    Uint64 word;
+    memcpy(&word, key + i, 8);
+    h = (h ^ word) * 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 32;
+  }
+  return h;
+}
+
+void TileCache::unlink(int i) {
+  Entry &e = entries[i];
+  if (e.older != -1) entries[e.older].newer = e.newer;
+  else oldest = e.newer;
+  if (e.newer != -1) entries[e.newer].older = e.older;
+  else newest = e.older;
+}
+
+void TileCache::make_newest(int i) {
+  Entry &e = entries[i];
+  e.older = newest;
+  e.newer = -1;
+  if (newest != -1) entries[newest].newer = i;
+  newest = i;
+  if (oldest == -1) oldest = i;
+}
+
+void TileCache::evict(int i) {
+  //Out of its bucket and off the LRU list, so the slot can be reused
+  int *link = &buckets[entries[i].hash & (buckets.size()-1)];
+  while (*link != i) {
+    link = &entries[*link].chain;
+  }
+  *link = entries[i].chain;
+  unlink(i);
+  stats.evictions++;
+}
+
+const Uint8 *TileCache::find(const Uint8 *key, Uint64 hash) {
+  for (int i = buckets[hash & (buckets.size()-1)]; i != -1; i = entries[i].chain) {
+    Entry &e = entries[i];
+    if (e.hash == hash && !memcmp(e.key, key, tile_key_cells)) {
+      if (i != newest) {
+        unlink(i);
+        make_newest(i);
+      }
+      stats.hits++;
+      return e.next;
+    }
+  }
+  stats.misses++;
+  return NULL;
+}
+
+void TileCache::insert(const Uint8 *key, Uint64 hash, const Uint8 *next) {
+  int i;
+  if ((int)entries.size() < capacity) {
+    i = entries.size();
+    entries.push_back(Entry());
+  }
+  else {
+    i = oldest;
+    evict(i);
+  }
+  Entry &e = entries[i];
+  e.hash = hash;
+  memcpy(e.key, key, tile_key_cells);
+  memcpy(e.next, next, tile_cells);
+  int &bucket = buckets[hash & (buckets.size()-1)];
+  e.chain = bucket;
+  bucket = i;
+  make_newest(i);
+}
+
+const TileCache::Stats &TileCache::get_stats() const {
+  return stats;
+}
+
+void TileCache::reset_stats() {
+  stats = Stats();
+}
@@ -0,0 +1,60 @@
+
+#ifndef TILECACHE_H
+#define TILECACHE_H
+
+#include <vector>
+
+#include <SDL/SDL.h>
+
+const int tile_shift = 2;
+const int tile_size = 1 << tile_shift;
+const int tile_cells = tile_size*tile_size;
+const int tile_border = 2; //how far away a cell can be and still change the tile
+const int tile_key_size = tile_size + 2*tile_border;
+const int tile_key_cells = tile_key_size*tile_key_size;
+
+/*
+Remembers what a tile of cells turns into. The key is the tile plus the
+ring of cells around it that can affect it in one tick, row after row; the
+value is the tile on the next tick. When it's full the entry that went
+longest without being used gets thrown out.
+*/
+class TileCache {
+public:
+  struct Stats {
+    unsigned long hits, misses, evictions;
+    unsigned long uncached; //tiles on the edge of the active region
+    unsigned long empty; //all air, so not looked up
+    Stats();
+  };
+
+private:
+  struct Entry {
+    Uint64 hash;
+    Uint8 key[tile_key_cells];
+    Uint8 next[tile_cells];
+    int older, newer; //the LRU list
+    int chain; //next entry in the same bucket
+  };
+  std::vector<Entry> entries;
+  std::vector<int> buckets;
+  int capacity;
+  int newest, oldest;
+  Stats stats;
+
+  void unlink(int i);
+  void make_newest(int i);
+  void evict(int i);
+
+public:
+  TileCache(int capacity = 1 << 14);
+  static Uint64 hash(const Uint8 *key);
+  const Uint8 *find(const Uint8 *key, Uint64 hash);
+  void insert(const Uint8 *key, Uint64 hash, const Uint8 *next);
+  inline void uncached() { stats.uncached++; }
+  inline void empty() { stats.empty++; }
+  const Stats &get_stats() const;
+  void reset_stats();
+};
+
+#endif /* TILECACHE_H */
@@ -0,0 +1,42 @@
+
+#include "Viewport.h"
+
+#include <algorithm>
+
+Viewport::Viewport(int w, int h) : x(0), y(0), cell_pixels(block_pixel_size), lod(0), screen_w(w), screen_h(h) {}
+
+Region Viewport::visible() const {
+  //Partly visible cells count
+  return Region(x, y,
+      x + ((screen_w << lod) + cell_pixels - 1)/cell_pixels - 1,
+      y + ((screen_h << lod) + cell_pixels - 1)/cell_pixels - 1);
+}
+
+Coord Viewport::to_cell(int px, int py) const {
+  //Round towards negative infinity so things left of the screen stay there
+  px = (px - 1) << lod;
+  py = (py - 1) << lod;
+  int cx = px >= 0 ? px/cell_pixels : -((cell_pixels - 1 - px)/cell_pixels);
+  int cy = py >= 0 ? py/cell_pixels : -((cell_pixels - 1 - py)/cell_pixels);
+  return Coord(x + cx, y + cy);
+}
+
+void Viewport::pan(int dx, int dy) {
+  x += dx;
+  y += dy;
+}
+
+void Viewport::zoom(int steps, int px, int py) {
+  //Keep the cell under (px, py) where it is
+  Coord anchor = to_cell(px, py);
+  for (; steps > 0; steps--) {
+    if (lod > 0) lod--;
+    else cell_pixels = std::min(cell_pixels*2, block_pixel_size);
+  }
+  for (; steps < 0; steps++) {
+    if (cell_pixels > 1) cell_pixels = std::max(cell_pixels/2, 1);
+    else lod = std::min(lod + 1, max_lod);
+  }
+  x = anchor.x - ((px - 1) << lod)/cell_pixels;
+  y = anchor.y - ((py - 1) << lod)/cell_pixels;
+}
@@ -0,0 +1,28 @@
+
+#ifndef VIEWPORT_H
+#define VIEWPORT_H
+
+#include "common.h"
+
+const int max_lod = 12;
+
+//The part of the world that's on screen
+class Viewport {
+public:
+  int x, y; //cell in the top left corner
+  int cell_pixels; //zoom, from 1 up to block_pixel_size
+  int lod; //zoomed out past one pixel per cell: each pixel covers 2^lod cells across
+  int screen_w, screen_h;
+
+  Viewport(int w, int h);
+
+  Region visible() const;
+  inline int screen_x(int cell_x) const { return ((cell_x - x)*cell_pixels) >> lod; }
+  inline int screen_y(int cell_y) const { return ((cell_y - y)*cell_pixels) >> lod; }
+  Coord to_cell(int px, int py) const;
+
+  void pan(int dx, int dy);
+  void zoom(int steps, int px, int py);
+};
+
+#endif /* VIEWPORT_H */
@@ -0,0 +1,89 @@
+
+#include "WorkerPool.h"
+#include "common.h"
+
+WorkerPool::WorkerPool(int thread_count) : job(NULL), data(NULL), count(0), next_index(0), finished(0), generation(0), quitting(false) {
+  lock = SDL_CreateMutex();
+  wake = SDL_CreateCond();
+  done = SDL_CreateCond();
+  if (lock == NULL || wake == NULL || done == NULL) {
+    sdl_error();
+  }
+  //The caller is a worker too
+  for (int i = 1; i < thread_count; i++) {
+    SDL_Thread *thread = SDL_CreateThread(worker, this);
+    if (thread == NULL) {
+      sdl_error();
+    }
+    threads.push_back(thread);
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  SDL_LockMutex(lock);
+  quitting = true;
+  SDL_CondBroadcast(wake);
+  SDL_UnlockMutex(lock);
+  for (size_t i = 0; i < threads.size(); i++) {
+    SDL_WaitThread(threads[i], NULL);
+  }
+  SDL_DestroyCond(done);
+  SDL_DestroyCond(wake);
+  SDL_DestroyMutex(lock);
+}
+
+int WorkerPool::size() {
+  return threads.size() + 1;
+}
+
+int WorkerPool::worker(void *pool) {
+  WorkerPool *self = (WorkerPool *)pool;
+  int seen = 0;
+  SDL_LockMutex(self->lock);
+  while (true) {
+    while (!self->quitting && self->generation == seen) {
+      SDL_CondWait(self->wake, self->lock);
+    }
+    if (self->quitting) break;
+    seen = self->generation;
+    self->work();
+  }
+  SDL_UnlockMutex(self->lock);
+  return 0;
+}
+
+void WorkerPool::work() {
+  //Called with the lock held; drops it while running jobs
+  while (next_index < count) {
+    int index = next_index++;
+    SDL_UnlockMutex(lock);
+    job(data, index);
+    SDL_LockMutex(lock);
+    if (++finished == count) {
+      SDL_CondBroadcast(done);
+    }
+  }
+}
+
+void WorkerPool::run(Job new_job, void *new_data, int new_count) {
+  if (new_count <= 0) return;
+  if (threads.empty()) {
+    for (int i = 0; i < new_count; i++) {
+      new_job(new_data, i);
+    }
+    return;
+  }
+  SDL_LockMutex(lock);
+  job = new_job;
+  data = new_data;
+  count = new_count;
+  next_index = 0;
+  finished = 0;
+  generation++;
+  SDL_CondBroadcast(wake);
+  work();
+  while (finished < count) {
+    SDL_CondWait(done, lock);
+  }
+  SDL_UnlockMutex(lock);
+}
@@ -0,0 +1,38 @@
+
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <vector>
+
+#include <SDL/SDL.h>
+#include <SDL/SDL_thread.h>
+
+/*
+A handful of threads that run a job over a range of indices. The calling
+thread helps out, and run() only returns once every index is done.
+*/
+class WorkerPool {
+public:
+  typedef void (*Job)(void *data, int index);
+
+private:
+  std::vector<SDL_Thread *> threads;
+  SDL_mutex *lock;
+  SDL_cond *wake, *done;
+  Job job;
+  void *data;
+  int count, next_index, finished;
+  int generation;
+  bool quitting;
+
+  static int worker(void *pool);
+  void work();
+
+public:
+  WorkerPool(int thread_count);
+  ~WorkerPool();
+  int size();
+  void run(Job job, void *data, int count);
+};
+
+#endif /* WORKERPOOL_H */
@@ -1,6 +1,8 @@
 #include "common.h"
 #include "SDL/SDL.h"
 
+#include <algorithm>
+#include <stdio.h>
 #include <stack>
 using namespace std;
 
@@ -9,6 +11,12 @@ void sdl_error() {
   exit(-1);
 }
 
+void sys_error(const char *what) {
+  //Same idea, for the C library
+  perror(what);
+  exit(-1);
+}
+
 
 
 Coord::Coord(int X, int Y) : x(X), y(Y) {}
@@ -34,6 +42,34 @@ Coord Coord::down() { return Coord(x, y+1); }
 Coord Coord::left() { return Coord(x-1, y); }
 Coord Coord::right() { return Coord(x+1, y); }
 
+Region::Region(int X0, int Y0, int X1, int Y1) : x0(X0), y0(Y0), x1(X1), y1(Y1) {}
+
+bool Region::operator==(const Region &b) const {
+  return x0 == b.x0 && y0 == b.y0 && x1 == b.x1 && y1 == b.y1;
+}
+
+bool Region::contains(int x, int y) const {
+  return x >= x0 && x <= x1 && y >= y0 && y <= y1;
+}
+
+bool Region::empty() const {
+  return x0 > x1 || y0 > y1;
+}
+
+Region Region::grow(int n) const {
+  return Region(x0 - n, y0 - n, x1 + n, y1 + n);
+}
+
+Region Region::merge(const Region &b) const {
+  //Smallest region covering both
+  if (empty()) return b;
+  if (b.empty()) return *this;
+  return Region(std::min(x0, b.x0), std::min(y0, b.y0), std::max(x1, b.x1), std::max(y1, b.y1));
+}
+
+Region Region::clip(const Region &b) const {
+  return Region(std::max(x0, b.x0), std::max(y0, b.y0), std::min(x1, b.x1), std::min(y1, b.y1));
+}
 
 
 /*
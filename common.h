@@ -10,12 +10,15 @@ const int grid_size = 80/4;
 const int block_pixel_size = 10*4;
 const int screen_size = grid_size*block_pixel_size;
 const int update_speed = 20;
+const int chunk_shift = 4;
+const int chunk_size = 1 << chunk_shift; //cells across a chunk
 
 inline int sign(int x) {
   return x > 0 ? 1 : (x < 0 ? -1 : 0);
 }
 
 void sdl_error();
+void sys_error(const char *what);
 
 struct Coord {
   int x, y;
@@ -30,6 +33,20 @@ struct Coord {
   Coord right();
 };
 
+//A rectangle of cells, corners included
+struct Region {
+  int x0, y0, x1, y1;
+  Region(int X0, int Y0, int X1, int Y1);
+  bool operator==(const Region &b) const;
+  bool contains(int x, int y) const;
+  bool empty() const;
+  Region grow(int n) const;
+  Region merge(const Region &b) const;
+  Region clip(const Region &b) const;
+};
+
+Uint32 getpixel(SDL_Surface *surface, int x, int y);
+void putpixel(SDL_Surface *surface, int x, int y, Uint32 pixel);
 void retardo_flood_fill(SDL_Surface *surface, int x, int y, Uint32 color);
 
 #endif /* COMMON_H */
@@ -1,18 +1,86 @@
 
 
 #include <iostream>
+#include <fstream>
 #include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 #include <SDL/SDL.h>
 
 #include "CellData.h"
 #include "common.h"
 #include "Physics.h"
+#include "Scene.h"
+#include "Snapshot.h"
+#include "Frames.h"
+#include "Ensemble.h"
+#include "Diff.h"
 
 using namespace std;
 
 
+struct Options {
+  int width, height;
+  int margin; //-1 simulates everything
+  Region region; //what gets simulated, if not empty
+  int threads;
+  int processes;
+  Uint64 seed;
+  int max_ticks; //-1 picks a default for the mode
+  Engine engine;
+  Rules rules;
+  const char *autosave;
+  int autosave_every;
+  const char *frames; //prefix for exported frames
+  int frame_every, frame_scale, frame_threads;
+  FrameExporter::Format frame_format;
+  int history; //ticks to keep for rewinding, in a window; none unless asked for
+  int history_mb;
+
+  Options() : width(grid_size), height(grid_size), margin(-1), region(0, 0, -1, -1), threads(1), processes(1), seed(0), max_ticks(-1), engine(PLAIN_ENGINE), rules(STEP_RULES), autosave(NULL), autosave_every(1000),
+    frames(NULL), frame_every(1), frame_scale(4), frame_threads(2), frame_format(FrameExporter::PNG),
+    history(0), history_mb(256) {}
+};
+
+const char *engine_names[ENGINE_COUNT] = {"plain", "tiles"};
+const char *rules_names[RULES_COUNT] = {"step", "velocity", "blocks"};
+
+void configure(SandGrid &grid, const Options &options) {
+  //Processes before threads, so nothing forks with threads running
+  grid.set_seed(options.seed);
+  grid.set_engine(options.engine);
+  grid.set_rules(options.rules);
+  grid.set_processes(options.processes);
+  grid.set_threads(options.threads);
+  if (!options.region.empty()) {
+    grid.set_active_region(options.region);
+  }
+}
+
+void print_stats(SandGrid &grid) {
+  //Whether the tile cache is earning its keep
+  const TileCache::Stats *tiles = grid.tile_stats();
+  if (tiles != NULL) {
+    unsigned long lookups = tiles->hits + tiles->misses;
+    cout << "Tile cache: " << tiles->hits << " hits, " << tiles->misses << " misses";
+    if (lookups) {
+      cout << " (" << 100*tiles->hits/lookups << "%)";
+    }
+    cout << ", " << tiles->evictions << " evicted, " << tiles->empty << " empty and "
+      << tiles->uncached << " edge tiles" << endl;
+  }
+}
+
+
 
 
 
@@ -25,25 +93,70 @@ Uint32 draw_timer_callback(Uint32 interval, void *param) {
 }
 
 
-void app_loop(SDL_Surface *screen) {
-  SandGrid grid;
+void autosave_tick(SnapshotWriter &autosave, SandGrid &grid, const Options &options) {
+  //Every so many ticks, written out on another thread
+  if (options.autosave != NULL && grid.ticks() % options.autosave_every == 0) {
+    autosave.save(grid, options.autosave);
+  }
+}
+
+void finish_autosave(SnapshotWriter &autosave, const Options &options) {
+  if (options.autosave != NULL) {
+    autosave.wait();
+    cout << "Saved " << autosave.saves() << " snapshots, skipped " << autosave.skips() << endl;
+  }
+}
+
+void app_loop(SDL_Surface *screen, SandGrid &grid, const Options &options) {
   SDL_Event event;
+  SnapshotWriter autosave;
   CellType place_type = SAND;
   bool do_update = true;
+  Viewport view(screen_size, screen_size);
+  //Mouse strokes pile up here and get applied once per frame
+  EditBatch stroke;
+  Coord stroke_end(0, 0);
 
-  SDL_AddTimer(update_speed, draw_timer_callback, NULL); //triggers a draw event every 50 ms
+  SDL_TimerID timer = SDL_AddTimer(update_speed, draw_timer_callback, NULL); //triggers a draw event every 50 ms
 
   while (SDL_WaitEvent(&event)) {
+    bool moved_view = false;
     switch (event.type) {
       case SDL_KEYDOWN:
         if (event.key.keysym.unicode == L'q') {
+          finish_autosave(autosave, options);
           return;
         }
+        else if (event.key.keysym.sym == SDLK_LEFT || event.key.keysym.sym == SDLK_RIGHT
+            || event.key.keysym.sym == SDLK_UP || event.key.keysym.sym == SDLK_DOWN) {
+          //A quarter of a screen at a time
+          int step = std::max(1, (screen_size << view.lod)/view.cell_pixels/4);
+          int dx = (event.key.keysym.sym == SDLK_RIGHT) - (event.key.keysym.sym == SDLK_LEFT);
+          int dy = (event.key.keysym.sym == SDLK_DOWN) - (event.key.keysym.sym == SDLK_UP);
+          view.pan(dx*step, dy*step);
+          moved_view = true;
+        }
+        else if (event.key.keysym.sym == SDLK_BACKSPACE) {
+          //A second back, or as far as the history goes
+          stroke.clear();
+          if (grid.rewind(grid.ticks() - 1000/update_speed)) {
+            cout << "Rewound to tick " << grid.ticks() << endl;
+            grid.draw(screen, view);
+          }
+        }
+        else if (event.key.keysym.unicode == L'+' || event.key.keysym.unicode == L'=') {
+          view.zoom(1, screen_size/2, screen_size/2);
+          moved_view = true;
+        }
+        else if (event.key.keysym.unicode == L'-') {
+          view.zoom(-1, screen_size/2, screen_size/2);
+          moved_view = true;
+        }
         else {
           CellType new_type = CellData::lookup(event.key.keysym.unicode);
           if (new_type != BAD_CELL_TYPE) {
             place_type = new_type;
-            grid.mouse_set(place_type);
+            grid.mouse_set(place_type, view);
           }
         }
         break;
@@ -55,46 +168,492 @@ void app_loop(SDL_Surface *screen) {
         if (event.key.keysym.sym == SDLK_PERIOD) {
           if (!do_update) {
             grid.update(true);
-            grid.draw(screen);
+            autosave_tick(autosave, grid, options);
+            grid.draw(screen, view);
           }
         }
+        break;
 
-      case SDL_MOUSEMOTION:
       case SDL_MOUSEBUTTONDOWN:
-        {
-          Uint8 mouse_button = 0;
+        stroke_end = view.to_cell(event.button.x, event.button.y);
+        if (event.button.button == SDL_BUTTON_WHEELUP || event.button.button == SDL_BUTTON_WHEELDOWN) {
+          view.zoom(event.button.button == SDL_BUTTON_WHEELUP ? 1 : -1, event.button.x, event.button.y);
+          moved_view = true;
+        }
+        else if (event.button.button == SDL_BUTTON_LEFT) {
+          //Use the previous type
+          stroke.point(stroke_end, place_type);
+        }
+        else if (event.button.button == SDL_BUTTON_MIDDLE) {
+          stroke.point(stroke_end, AIR);
+        }
+        else if (event.button.button == SDL_BUTTON_RIGHT) {
+          cout << "Mouse at: " << stroke_end << endl;
+        }
+        break;
 
-          if (event.type == SDL_MOUSEBUTTONDOWN) {
-            mouse_button = event.button.button;
-          }
-          else {
-            mouse_button = event.motion.state;
-          }
-          if (mouse_button == SDL_BUTTON_LEFT) {
-            //Use the previous type
-            grid.mouse_set(place_type);
-          }
-          else if (mouse_button == SDL_BUTTON_MIDDLE) {
-            grid.mouse_set(AIR);
+      case SDL_MOUSEMOTION:
+        {
+          Coord here = view.to_cell(event.motion.x, event.motion.y);
+          if (event.motion.state & SDL_BUTTON(SDL_BUTTON_LEFT)) {
+            stroke.line(stroke_end, here, place_type);
           }
-          else if (mouse_button == SDL_BUTTON_RIGHT) {
-            grid.mouse_set(BAD_CELL_TYPE);
+          else if (event.motion.state & SDL_BUTTON(SDL_BUTTON_MIDDLE)) {
+            stroke.line(stroke_end, here, AIR);
           }
+          stroke_end = here;
         }
         break;
 
       case SDL_USEREVENT:
+        grid.apply(stroke);
+        stroke.clear();
         grid.update(do_update);
-        grid.draw(screen);
+        if (do_update) {
+          autosave_tick(autosave, grid, options);
+        }
+        grid.draw(screen, view);
+        if (timer != NULL && grid.idle(do_update)) {
+          //Stop ticking until something gets edited
+          SDL_RemoveTimer(timer);
+          timer = NULL;
+        }
         break;
 
       case SDL_QUIT:
+        finish_autosave(autosave, options);
         return;
     }
+    if (moved_view) {
+      if (options.margin >= 0) {
+        grid.set_active_region(view.visible().grow(options.margin));
+      }
+      grid.draw(screen, view);
+    }
+    if (timer == NULL && (!grid.idle(do_update) || !stroke.empty())) {
+      timer = SDL_AddTimer(update_speed, draw_timer_callback, NULL);
+    }
   }
+  finish_autosave(autosave, options);
 }
 
-int main() {
+void finish_frames(FrameExporter &frames, const timeval &start) {
+  //Simulating is done; the pictures may not be
+  timeval stop, done;
+  gettimeofday(&stop, NULL);
+  frames.finish();
+  gettimeofday(&done, NULL);
+  double simulating = (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec)/1e6;
+  double exporting = (done.tv_sec - start.tv_sec) + (done.tv_usec - start.tv_usec)/1e6;
+  cout << "Wrote " << frames.frames_written() << " frames in " << exporting << "s ("
+    << simulating << "s simulating), dropped " << frames.frames_dropped() << endl;
+  if (frames.frames_failed()) {
+    cout << frames.frames_failed() << " frames couldn't be written" << endl;
+  }
+}
+
+int headless_loop(SandGrid &grid, int max_ticks, bool settle, const Options &options) {
+  //No window, just tick. With 'settle' we stop early once nothing moves.
+  SnapshotWriter autosave;
+  FrameExporter *frames = NULL;
+  if (options.frames != NULL) {
+    frames = new FrameExporter(options.frames, options.frame_format, options.frame_scale, options.frame_threads);
+    frames->add(grid);
+  }
+  timeval start;
+  gettimeofday(&start, NULL);
+  while (grid.ticks() < max_ticks) {
+    grid.update(true);
+    autosave_tick(autosave, grid, options);
+    if (frames != NULL && grid.ticks() % options.frame_every == 0) {
+      frames->add(grid);
+    }
+    if (settle && grid.is_settled()) break;
+  }
+  if (frames != NULL) {
+    finish_frames(*frames, start);
+    delete frames;
+  }
+  finish_autosave(autosave, options);
+
+  if (settle) {
+    cout << (grid.is_settled() ? "Settled" : "Not settled") << " after " << grid.ticks() << " ticks" << endl;
+    print_stats(grid);
+    return grid.is_settled() ? 0 : 1;
+  }
+  cout << "Ran " << grid.ticks() << " ticks, cells take " << grid.bytes()/1024 << "K" << endl;
+  print_stats(grid);
+  return 0;
+}
+
+string narrow(const wchar_t *s) {
+  //Cell names are plain ASCII
+  string r;
+  for (; *s; s++) r += (char)*s;
+  return r;
+}
+
+int diff_loop(const vector<const char *> &scenes, int random_scenes, const Options &options) {
+  //Every scene runs on the reference engine and on a grid set up from the options
+  int failures = 0;
+  for (int i = 0; i < (int)scenes.size() + random_scenes; i++) {
+    SandGrid candidate(options.width, options.height);
+    configure(candidate, options);
+    string name;
+    if (i < (int)scenes.size()) {
+      name = scenes[i];
+      if (!load_scene(candidate, scenes[i])) {
+        return -1;
+      }
+    }
+    else {
+      Uint64 scene_seed = options.seed + i - scenes.size();
+      ostringstream random_name;
+      random_name << "random scene " << scene_seed;
+      name = random_name.str();
+      EditBatch batch;
+      random_scene(batch, options.width, options.height, scene_seed);
+      candidate.apply(batch);
+    }
+    //The rules and the region change the world, so the reference gets them too
+    ReferenceGrid reference(candidate.current(), options.rules, options.seed);
+    if (!options.region.empty()) {
+      reference.set_region(options.region);
+    }
+
+    Divergence where;
+    if (diff_run(reference, candidate, options.max_ticks, where)) {
+      cout << name << ": same for " << reference.ticks() << " ticks" << endl;
+      print_stats(candidate);
+    }
+    else {
+      failures++;
+      cout << name << ": " << where.what << " diverged at tick " << where.tick;
+      if (where.expected != BAD_CELL_TYPE) {
+        cout << ", cell " << where.cell << " should be " << narrow(CellData::name(where.expected))
+          << " but is " << narrow(CellData::name(where.got));
+      }
+      cout << endl;
+    }
+  }
+  return failures ? 1 : 0;
+}
+
+int monitor_loop(const char *name) {
+  //Print another sand's counters as they come in, until it goes away
+  CounterRing ring;
+  if (!ring.attach(name)) {
+    return -1;
+  }
+  CounterRing::print_header(stdout);
+  Uint64 seen = ring.head();
+  while (true) {
+    bool closed = ring.closed();
+    Uint64 head = ring.head();
+    if (head - seen > SAND_COUNTERS_SLOTS) {
+      seen = head - SAND_COUNTERS_SLOTS; //fell behind, skip ahead
+    }
+    for (; seen < head; seen++) {
+      sand_tick_counters record;
+      if (ring.read(seen, record)) {
+        CounterRing::print(stdout, record);
+      }
+    }
+    fflush(stdout);
+    if (closed) break;
+    usleep(100*1000);
+  }
+  return 0;
+}
+
+int watch_loop(const char *path, bool headless) {
+  //Follow another sand's --stream. Headless just reads to the end and says
+  //what the world came to, which is handy for checking the stream.
+  DeltaReader reader;
+  int width, height;
+  if (!reader.open(path, width, height)) {
+    return -1;
+  }
+  CellGrid cells(width, height);
+  int tick = 0, count = 0;
+  long long changes = 0, updates = 0;
+  if (headless) {
+    while (reader.next(cells, tick, count)) {
+      changes += count;
+      updates++;
+    }
+    cout << "Read " << updates << " updates, " << changes << " changes, to tick " << cells.ticks
+      << ", hash " << hex << hash_cells(cells) << dec << endl;
+    return 0;
+  }
+
+  if (SDL_Init(SDL_INIT_VIDEO)) {
+    sdl_error();
+  }
+  SDL_Surface *screen = SDL_SetVideoMode(screen_size+2, screen_size+2, 0, 0);
+  if (screen == NULL) {
+    sdl_error();
+  }
+  CellData::init_color(screen);
+  SDL_WM_SetCaption("sand (watching)", "sand");
+  atexit(SDL_Quit);
+  GridRenderer renderer;
+  Viewport view(screen_size, screen_size);
+  view.cell_pixels = std::min(block_pixel_size, std::max(1, screen_size/std::max(width, height)));
+  while (reader.next(cells, tick, count)) {
+    SDL_Event event;
+    while (SDL_PollEvent(&event)) {
+      if (event.type == SDL_QUIT) return 0;
+    }
+    if (count == 0) continue;
+    SDL_FillRect(screen, NULL, CellData::color(AIR));
+    renderer.draw(screen, cells, view);
+    SDL_UpdateRect(screen, 0, 0, 0, 0);
+  }
+  cout << "Stream ended at tick " << cells.ticks << endl;
+  return 0;
+}
+
+int ensemble_loop(const vector<const char *> &scenes, int random_scenes, const Options &options, const char *out_path) {
+  //Every scene and random scene as its own world, spread over the threads
+  Ensemble ensemble(options.width, options.height);
+  ensemble.set_seed(options.seed);
+  ensemble.set_engine(options.engine);
+  ensemble.set_rules(options.rules);
+  for (size_t i = 0; i < scenes.size(); i++) {
+    ensemble.add_scene(scenes[i]);
+  }
+  for (int i = 0; i < random_scenes; i++) {
+    ensemble.add_random(options.seed + i);
+  }
+  timeval start, done;
+  gettimeofday(&start, NULL);
+  ensemble.run(options.max_ticks, options.threads);
+  gettimeofday(&done, NULL);
+
+  if (out_path != NULL) {
+    ofstream out(out_path);
+    ensemble.write(out);
+    out.close();
+    if (!out) {
+      cerr << "Couldn't write " << out_path << endl;
+      return -1;
+    }
+  }
+  else {
+    ensemble.write(cout);
+  }
+  cerr << "Ran " << ensemble.size() << " worlds in "
+    << (done.tv_sec - start.tv_sec) + (done.tv_usec - start.tv_usec)/1e6 << "s" << endl;
+  const vector<Ensemble::Result> &results = ensemble.get_results();
+  for (size_t i = 0; i < results.size(); i++) {
+    if (!results[i].loaded) return 1;
+  }
+  return 0;
+}
+
+void usage() {
+  cerr << "Usage: sand [scene] [--size WxH] [--margin N] [--threads N] [--seed N] [--engine plain|tiles]" << endl;
+  cerr << "            [--headless] [--processes N] [--ticks N] [--settle] [--rules step|velocity|blocks]" << endl;
+  cerr << "            [--region X0,Y0,X1,Y1]" << endl;
+  cerr << "       sand --diff [scene...] [--random N] [--size WxH] [--threads N] [--processes N] [--seed N]" << endl;
+  cerr << "            [--engine plain|tiles] [--rules step|velocity|blocks] [--region X0,Y0,X1,Y1] [--ticks N]" << endl;
+  cerr << "       sand [...] --counters NAME [--dump FILE] [--dump-every N]" << endl;
+  cerr << "       sand [...] --autosave FILE [--autosave-every N]" << endl;
+  cerr << "       sand [...] --headless --frames PREFIX [--frame-every N] [--frame-scale N]" << endl;
+  cerr << "            [--frame-format raw|png] [--frame-threads N]" << endl;
+  cerr << "       sand --ensemble [scene...] [--random N] [--size WxH] [--ticks N] [--threads N]" << endl;
+  cerr << "            [--seed N] [--engine E] [--rules R] [--out FILE]" << endl;
+  cerr << "       sand [...] --stream FILE" << endl;
+  cerr << "       sand [...] --history TICKS [--history-mb N]" << endl;
+  cerr << "       sand --monitor NAME" << endl;
+  cerr << "       sand --watch FILE [--headless]" << endl;
+  exit(-1);
+}
+
+int main(int argc, char **argv) {
+  Options options;
+  bool headless = false, settle = false, diff = false, ensemble = false;
+  int random_scenes = 0;
+  vector<const char *> scenes;
+  const char *counters_name = NULL, *dump_path = NULL, *monitor = NULL, *out_path = NULL;
+  const char *stream_path = NULL, *watch = NULL;
+  int dump_every = 100;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--headless")) {
+      headless = true;
+    }
+    else if (!strcmp(argv[i], "--settle")) {
+      settle = true;
+    }
+    else if (!strcmp(argv[i], "--velocity")) {
+      options.rules = VELOCITY_RULES;
+    }
+    else if (!strcmp(argv[i], "--rules") && i+1 < argc) {
+      i++;
+      int r = 0;
+      while (r < RULES_COUNT && strcmp(argv[i], rules_names[r])) r++;
+      if (r == RULES_COUNT) {
+        usage();
+      }
+      options.rules = (Rules)r;
+    }
+    else if (!strcmp(argv[i], "--diff")) {
+      diff = true;
+    }
+    else if (!strcmp(argv[i], "--ensemble")) {
+      ensemble = true;
+    }
+    else if (!strcmp(argv[i], "--out") && i+1 < argc) {
+      out_path = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--random") && i+1 < argc) {
+      random_scenes = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--counters") && i+1 < argc) {
+      counters_name = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--dump") && i+1 < argc) {
+      dump_path = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--dump-every") && i+1 < argc) {
+      dump_every = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--autosave") && i+1 < argc) {
+      options.autosave = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--autosave-every") && i+1 < argc) {
+      options.autosave_every = std::max(1, atoi(argv[++i]));
+    }
+    else if (!strcmp(argv[i], "--frames") && i+1 < argc) {
+      options.frames = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--frame-every") && i+1 < argc) {
+      options.frame_every = std::max(1, atoi(argv[++i]));
+    }
+    else if (!strcmp(argv[i], "--frame-scale") && i+1 < argc) {
+      options.frame_scale = std::min(std::max(1, atoi(argv[++i])), block_pixel_size);
+    }
+    else if (!strcmp(argv[i], "--frame-threads") && i+1 < argc) {
+      options.frame_threads = std::max(1, atoi(argv[++i]));
+    }
+    else if (!strcmp(argv[i], "--frame-format") && i+1 < argc) {
+      i++;
+      int f = 0;
+      while (f < FrameExporter::FORMAT_COUNT && strcmp(argv[i], frame_format_names[f])) f++;
+      if (f == FrameExporter::FORMAT_COUNT) {
+        usage();
+      }
+      options.frame_format = (FrameExporter::Format)f;
+    }
+    else if (!strcmp(argv[i], "--monitor") && i+1 < argc) {
+      monitor = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--history") && i+1 < argc) {
+      options.history = std::max(0, atoi(argv[++i]));
+    }
+    else if (!strcmp(argv[i], "--history-mb") && i+1 < argc) {
+      options.history_mb = std::max(1, atoi(argv[++i]));
+    }
+    else if (!strcmp(argv[i], "--stream") && i+1 < argc) {
+      stream_path = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--watch") && i+1 < argc) {
+      watch = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--ticks") && i+1 < argc) {
+      options.max_ticks = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--size") && i+1 < argc) {
+      if (sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2
+          || options.width <= 0 || options.height <= 0) {
+        usage();
+      }
+    }
+    else if (!strcmp(argv[i], "--threads") && i+1 < argc) {
+      options.threads = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--processes") && i+1 < argc) {
+      options.processes = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--seed") && i+1 < argc) {
+      options.seed = strtoull(argv[++i], NULL, 0);
+    }
+    else if (!strcmp(argv[i], "--engine") && i+1 < argc) {
+      i++;
+      int e = 0;
+      while (e < ENGINE_COUNT && strcmp(argv[i], engine_names[e])) e++;
+      if (e == ENGINE_COUNT) {
+        usage();
+      }
+      options.engine = (Engine)e;
+    }
+    else if (!strcmp(argv[i], "--margin") && i+1 < argc) {
+      options.margin = std::max(0, atoi(argv[++i]));
+    }
+    else if (!strcmp(argv[i], "--region") && i+1 < argc) {
+      Region &r = options.region;
+      if (sscanf(argv[++i], "%d,%d,%d,%d", &r.x0, &r.y0, &r.x1, &r.y1) != 4 || r.empty()) {
+        usage();
+      }
+    }
+    else if (argv[i][0] == '-') {
+      usage();
+    }
+    else {
+      scenes.push_back(argv[i]);
+    }
+  }
+
+  if (monitor != NULL) {
+    return monitor_loop(monitor);
+  }
+  if (watch != NULL) {
+    return watch_loop(watch, headless);
+  }
+  if (diff) {
+    if (options.max_ticks < 0) options.max_ticks = 2000;
+    return diff_loop(scenes, random_scenes, options);
+  }
+  if (ensemble) {
+    if (options.max_ticks < 0) options.max_ticks = 2000;
+    return ensemble_loop(scenes, random_scenes, options, out_path);
+  }
+  if (scenes.size() > 1) {
+    usage();
+  }
+
+  //A snapshot brings its own size
+  bool snapshot = scenes.size() && read_snapshot_size(scenes[0], options.width, options.height);
+  CounterRing counters; //these outlive the grid
+  DeltaJournal journal;
+  DeltaStream stream;
+  TickHistory history(options.history, (size_t)options.history_mb << 20);
+  SandGrid grid(options.width, options.height);
+  configure(grid, options);
+  if (scenes.size() && !(snapshot ? load_snapshot(grid, scenes[0]) : load_scene(grid, scenes[0]))) {
+    return -1;
+  }
+  if (counters_name != NULL || dump_path != NULL) {
+    if (counters_name != NULL && !counters.publish(counters_name)) {
+      return -1;
+    }
+    if (dump_path != NULL && !counters.dump_to(dump_path, dump_every)) {
+      return -1;
+    }
+    grid.set_counters(&counters);
+  }
+  if (stream_path != NULL) {
+    if (!stream.open(stream_path, options.width, options.height, journal)) {
+      return -1;
+    }
+    grid.set_journal(&journal);
+  }
+
+  if (headless) {
+    if (options.max_ticks < 0) options.max_ticks = 100000;
+    return headless_loop(grid, options.max_ticks, settle, options);
+  }
   if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER)) {
     sdl_error();
   }
@@ -111,7 +670,13 @@ int main() {
   atexit(SDL_Quit);
   SDL_EnableKeyRepeat(SDL_DEFAULT_REPEAT_INTERVAL, SDL_DEFAULT_REPEAT_INTERVAL);
 
-  app_loop(screen);
+  if (options.history > 0) {
+    grid.set_history(&history);
+  }
+  if (options.margin >= 0) {
+    grid.set_active_region(Viewport(screen_size, screen_size).visible().grow(options.margin));
+  }
+  app_loop(screen, grid, options);
 
   return 0;
 }
@@ -0,0 +1,138 @@
+#ifndef SAND_H
+#define SAND_H
+
+/*
+C interface for driving the simulation from other programs.
+
+Edits are queued and written into the world between ticks: at the start
+of the next sand_step(), or right away with sand_apply_edits(). Coordinates
+are in cells, and every range is inclusive.
+*/
+
+#include "sand_counters.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sand_world sand_world;
+
+/* Same values as CellType */
+enum sand_cell {
+  SAND_AIR = 0,
+  SAND_SAND,
+  SAND_ROCK,
+  SAND_EXPOSED_WATER,
+  SAND_INACTIVE_WATER,
+  SAND_CLONER,
+  SAND_DESTROYER,
+  SAND_CELL_COUNT
+};
+
+/* Called after every tick, from inside sand_step() */
+typedef void (*sand_tick_callback)(sand_world *world, int tick, void *user);
+
+sand_world *sand_create(int width, int height);
+void sand_destroy(sand_world *world);
+
+int sand_width(sand_world *world);
+int sand_height(sand_world *world);
+int sand_ticks(sand_world *world);
+/* 1 once a tick changed nothing; edits wake it up again */
+int sand_settled(sand_world *world);
+
+/* Runs up to 'ticks' ticks, stopping early if the world settles.
+   Returns how many ticks actually ran. */
+int sand_step(sand_world *world, int ticks);
+void sand_set_tick_callback(sand_world *world, sand_tick_callback callback, void *user);
+/* Seeds the physics' tie-breaking. The same seed and edits always give
+   the same world, however many threads are used. */
+void sand_set_seed(sand_world *world, unsigned long long seed);
+/* Solve separate bodies of water on this many threads. Results are the
+   same as with one. */
+void sand_set_threads(sand_world *world, int threads);
+/* Only simulate cells x0..x1, y0..y1; everything else stays frozen */
+void sand_set_active_region(sand_world *world, int x0, int y0, int x1, int y1);
+
+/* Same values as Engine. Every engine gives the same world. */
+enum sand_engine {
+  SAND_ENGINE_PLAIN = 0,
+  SAND_ENGINE_TILES, /* remembers what repeating patterns turn into */
+  SAND_ENGINE_COUNT
+};
+void sand_set_engine(sand_world *world, int engine);
+/* Same values as Rules. Unlike engines these change what the world does,
+   and the engine and process settings are ignored for anything but
+   SAND_RULES_STEP. */
+enum sand_rules {
+  SAND_RULES_STEP = 0,
+  SAND_RULES_VELOCITY, /* falling things speed up, more than a cell a tick */
+  SAND_RULES_BLOCKS, /* 2x2 blocks that each change on their own */
+  SAND_RULES_COUNT
+};
+void sand_set_rules(sand_world *world, int rules);
+/* sand_set_rules(world, on ? SAND_RULES_VELOCITY : SAND_RULES_STEP) */
+void sand_set_velocity(sand_world *world, int on);
+/* Tile cache lookups so far; both 0 if the tile engine was never used */
+void sand_tile_stats(sand_world *world, unsigned long *hits, unsigned long *misses);
+
+void sand_fill_span(sand_world *world, int x0, int x1, int y, int cell);
+void sand_fill_rect(sand_world *world, int x0, int y0, int x1, int y1, int cell);
+void sand_draw_line(sand_world *world, int x0, int y0, int x1, int y1, int radius, int cell);
+void sand_fill_circle(sand_world *world, int x, int y, int radius, int cell);
+void sand_flood_replace(sand_world *world, int x, int y, int cell);
+void sand_apply_edits(sand_world *world);
+
+/* Start counting what every tick does (see sand_counters.h). With a name
+   the counters also go into POSIX shared memory for sand --monitor and
+   the like. Returns 0, or -1 if the shared memory couldn't be set up. */
+int sand_publish_counters(sand_world *world, const char *name);
+/* The newest record; 0 if there isn't one */
+int sand_last_counters(sand_world *world, sand_tick_counters *counters);
+
+/* Starts saving the world to 'path' on a background thread and returns
+   straight away; ticking carries on while it writes. Returns -1 if the
+   last save is still going (this one's skipped) or if the one before
+   failed. */
+int sand_save_snapshot(sand_world *world, const char *path);
+/* Waits for a save in progress. 0 if it worked. */
+int sand_wait_snapshots(sand_world *world);
+/* Carries on from a saved snapshot, which has to be the same size as the
+   world. 0 if it worked. */
+int sand_load_snapshot(sand_world *world, const char *path);
+
+/* A cell that changed, and what it was and is (sand_cell values) */
+typedef struct sand_change {
+  int x, y;
+  unsigned char was, is;
+} sand_change;
+/* Called after every tick with the cells it changed, edits included. The
+   first call has every cell that isn't air, unless something was already
+   following the changes. */
+typedef void (*sand_changes_callback)(sand_world *world, int tick, const sand_change *changes, int count, void *user);
+/* NULL stops it */
+void sand_set_changes_callback(sand_world *world, sand_changes_callback callback, void *user);
+/* Writes the changes to 'path' for sand --watch; a FIFO works. 0 if it
+   could be opened. */
+int sand_stream_changes(sand_world *world, const char *path);
+
+/* Keep up to 'ticks' past ticks (and about 'max_bytes' of them) to rewind
+   to, from now on; ticks where little changed take little. 0 ticks stops. */
+void sand_keep_history(sand_world *world, int ticks, unsigned long max_bytes);
+/* Back to the last kept tick no later than 'tick' (or the oldest kept),
+   forgetting everything after it. Pending edits are dropped too. Returns
+   the tick it went back to, or -1 if there was nothing to go back to.
+   Falling speeds start over. */
+int sand_rewind(sand_world *world, int tick);
+
+/* The current cells, one byte each: cell (x, y) is cells[y*stride + x].
+   No fresh copy is made; the world keeps a flat copy and only brings the
+   parts that changed up to date. So the pointer is only good until the
+   next call that steps or edits the world, or sand_destroy(). */
+const unsigned char *sand_cells(sand_world *world, int *stride);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SAND_H */
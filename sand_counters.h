@@ -0,0 +1,38 @@
+#ifndef SAND_COUNTERS_H
+#define SAND_COUNTERS_H
+
+/*
+What the world did each tick, published in POSIX shared memory so another
+process can watch without slowing the simulation down (see sand --monitor).
+
+The ring has one writer. A record's sequence is odd while it's being
+written and goes up by two every time it's rewritten; a reader copies the
+record out and keeps the copy only if the sequence was even and the same
+before and after. 'head' counts the records written so far, the newest is
+records[(head - 1) % slots].
+*/
+
+#define SAND_COUNTERS_MAGIC 0x53414E44 /* "SAND" */
+#define SAND_COUNTERS_VERSION 1
+#define SAND_COUNTERS_SLOTS 256
+#define SAND_COUNTERS_CELL_TYPES 8
+
+typedef struct sand_tick_counters {
+  volatile unsigned long long sequence;
+  long long tick;
+  long long cells[SAND_COUNTERS_CELL_TYPES]; /* how many of each cell type */
+  long long changed; /* cells the sand and replicator passes changed */
+  long long water_moved; /* cells of water moved sideways by the fluid step */
+  long long water_bodies; /* separate bodies of water it found */
+  long long dense_chunks; /* chunks unpacked because something's going on in them */
+  long long clones, destroys; /* cells cloned (other than air) and cells destroyed */
+} sand_tick_counters;
+
+typedef struct sand_counters_ring {
+  unsigned int magic, version, slots, record_size;
+  volatile unsigned long long head;
+  volatile int closed; /* the writer has gone */
+  sand_tick_counters records[SAND_COUNTERS_SLOTS];
+} sand_counters_ring;
+
+#endif /* SAND_COUNTERS_H */